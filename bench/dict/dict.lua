@@ -0,0 +1,25 @@
+-- /dict?zone=name&writes=percent&ops=number&keys=number
+--
+-- Runs ops gets and sets on random keys of ngx.shared[zone], writes
+-- percent of them being sets, so every request holds the zone locks
+-- many times while the other workers do the same.
+
+local r = ...;
+
+local dict = ngx.shared[r.args['zone'] or 'one'];
+local writes = tonumber(r.args['writes']) or 10;
+local ops = tonumber(r.args['ops']) or 100;
+local keys = tonumber(r.args['keys']) or 10000;
+
+for i = 1, ops do
+    local key = 'key' .. math.random(keys);
+
+    if math.random(100) <= writes then
+        dict:set(key, i);
+    else
+        dict:get(key);
+    end
+end
+
+r.echo('ok\n');
+r.exit(200);
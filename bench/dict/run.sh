@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# Runs wrk against every zone of nginx.conf at several write ratios.
+#
+#   ./run.sh /path/to/nginx
+#
+# WORKERS, THREADS, CONNECTIONS, DURATION, OPS and WRITES override the
+# defaults below.
+
+set -e
+
+NGINX=${1:?usage: $0 /path/to/nginx}
+WORKERS=${WORKERS:-$(nproc)}
+THREADS=${THREADS:-$WORKERS}
+CONNECTIONS=${CONNECTIONS:-$((WORKERS * 16))}
+DURATION=${DURATION:-10s}
+OPS=${OPS:-100}
+WRITES=${WRITES:-"100 10 1"}
+URL=http://127.0.0.1:8090/dict
+
+dir=$(cd "$(dirname "$0")" && pwd)
+prefix=$(mktemp -d)
+
+trap '"$NGINX" -p "$prefix/" -c nginx.conf -s stop 2>/dev/null;
+      rm -rf "$prefix"' EXIT
+
+mkdir "$prefix/logs"
+cp "$dir/dict.lua" "$prefix/"
+sed "s/^worker_processes .*/worker_processes  $WORKERS;/" \
+    "$dir/nginx.conf" > "$prefix/nginx.conf"
+
+"$NGINX" -p "$prefix/" -c nginx.conf
+sleep 1
+
+echo "workers $WORKERS, connections $CONNECTIONS, $OPS ops per request"
+
+for zone in one sharded lockfree; do
+    for writes in $WRITES; do
+        # fill the keys first, so gets find something
+        curl -s "$URL?zone=$zone&writes=100&ops=20000" > /dev/null
+
+        rps=$(wrk -t "$THREADS" -c "$CONNECTIONS" -d "$DURATION" \
+                  "$URL?zone=$zone&writes=$writes&ops=$OPS" \
+              | awk '/^Requests\/sec/ { print $2 }')
+
+        printf '%-10s writes %3s%%  %10s req/s\n' "$zone" "$writes" "$rps"
+    done
+done
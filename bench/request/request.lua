@@ -0,0 +1,23 @@
+-- /request?n=number
+--
+-- Reads r.uri, r.method, r.client_ip and r.headers n times each and
+-- answers with the time one read took on average, in nanoseconds.
+
+local r = ...;
+
+local n = tonumber(r.args['n']) or 100000;
+local x;
+
+local start = os.clock();
+
+for i = 1, n do
+    x = r.uri;
+    x = r.method;
+    x = r.client_ip;
+    x = r.headers;
+end
+
+local elapsed = os.clock() - start;
+
+r.echo(string.format('%.1f\n', elapsed * 1e9 / (n * 4)));
+r.exit(200);
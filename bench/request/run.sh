@@ -0,0 +1,44 @@
+#!/bin/sh
+#
+# Measures request property reads with every nginx binary given.
+#
+#   ./run.sh /path/to/nginx-before /path/to/nginx-after
+#
+# N (reads per property and request), RUNS, CONNECTIONS and DURATION
+# override the defaults below.
+
+set -e
+
+N=${N:-100000}
+RUNS=${RUNS:-5}
+CONNECTIONS=${CONNECTIONS:-16}
+DURATION=${DURATION:-10s}
+URL=http://127.0.0.1:8091/request
+
+dir=$(cd "$(dirname "$0")" && pwd)
+
+[ $# -gt 0 ] || { echo "usage: $0 /path/to/nginx ..." >&2; exit 1; }
+
+for nginx in "$@"; do
+    prefix=$(mktemp -d)
+
+    mkdir "$prefix/logs"
+    cp "$dir/nginx.conf" "$dir/request.lua" "$prefix/"
+
+    "$nginx" -p "$prefix/" -c nginx.conf
+    sleep 1
+
+    # a loop within one request, the time of one read
+    ns=$(for i in $(seq "$RUNS"); do curl -s "$URL?n=$N"; done \
+         | sort -n | head -1)
+
+    # many requests of one read each
+    rps=$(wrk -t 1 -c "$CONNECTIONS" -d "$DURATION" "$URL?n=1" \
+          | awk '/^Requests\/sec/ { print $2 }')
+
+    "$nginx" -p "$prefix/" -c nginx.conf -s stop
+    sleep 1
+    rm -rf "$prefix"
+
+    printf '%s\n    %8s ns per read  %10s req/s\n' "$nginx" "$ns" "$rps"
+done
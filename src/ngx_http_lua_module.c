@@ -3,11 +3,28 @@
  * Copyright (C) Zhidao HONG
  */
 
+#include <ngx_md5.h>
+#include <ngx_chb.h>
 #include <ngx_lua_core.h>
 #include <ngx_lua_http.h>
 
 typedef struct {
-    int             lua_ref;
+    ngx_str_t       name;
+    u_char          *chunkname;
+    int             ref;
+    time_t          mtime;
+    time_t          checked;
+} ngx_http_lua_file_t;
+
+typedef struct {
+    int                  lua_ref;
+    ngx_http_lua_file_t  *file;
+    int                  rewrite_ref;
+    int                  access_ref;
+    int                  header_filter_ref;
+    int                  body_filter_ref;
+    int                  log_ref;
+    ngx_uint_t           request_body;
 } ngx_http_lua_loc_conf_t;
 
 typedef struct {
@@ -15,28 +32,75 @@ typedef struct {
     ngx_str_t       script;
 } ngx_http_lua_parse_t;
 
+typedef struct {
+    ngx_str_node_t  sn;      /* keyed by the prefix and the script */
+    int             ref;
+} ngx_http_lua_chunk_t;
+
 typedef struct {
     int             ref;
     ngx_msec_t      interval;
     ngx_event_t     event;
     ngx_log_t       *log;
+    ngx_lua_conf_t  *conf;
 } ngx_lua_timer_t;
 
+#define NGX_HTTP_LUA_REWRITE  0x01
+#define NGX_HTTP_LUA_ACCESS   0x02
+#define NGX_HTTP_LUA_CONTENT  0x04
+
+#define NGX_HTTP_LUA_BODY_OFF       0
+#define NGX_HTTP_LUA_BODY_BUFFERED  1
+#define NGX_HTTP_LUA_BODY_STREAM    2
+
 static ngx_int_t ngx_http_lua_init_process(ngx_cycle_t *cycle);
+static ngx_int_t ngx_http_lua_send_response(ngx_http_request_t *r,
+    ngx_http_lua_ctx_t *ctx);
+static void ngx_http_lua_resume_handler(ngx_event_t *ev);
 static void ngx_http_lua_cleanup(void *data);
+static void ngx_http_lua_ctx_cleanup(void *data);
+static ngx_int_t ngx_http_lua_file_load(ngx_http_lua_main_conf_t *lmcf,
+    ngx_http_lua_file_t *file, ngx_log_t *log);
 static void ngx_lua_timer_handler(ngx_event_t *ev);
 static ngx_int_t ngx_http_lua_dict_init_zone(ngx_shm_zone_t *shm_zone,
     void *data);
 static ngx_int_t ngx_http_lua_init(ngx_conf_t *cf);
 static void *ngx_http_lua_create_main_conf(ngx_conf_t *cf);
+static char *ngx_http_lua_init_main_conf(ngx_conf_t *cf, void *conf);
 static void *ngx_http_lua_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_lua_merge_loc_conf(ngx_conf_t *cf, void *parent,
     void *child);
 static char *ngx_http_lua_script(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_lua_script_file(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_lua_phase_script(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 static char *ngx_http_lua_timer(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *ngx_http_lua_dict_zone(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_lua_bytecode_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_lua_var_index(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_str_t  ngx_http_lua_request_prefix =
+    ngx_string("local r = ...;");
+
+static ngx_str_t  ngx_http_lua_body_filter_prefix =
+    ngx_string("local r, chunk, eof = ...;");
+
+static ngx_str_t  ngx_http_lua_timer_prefix =
+    ngx_string("local conf = ...;");
+
+
+static ngx_conf_enum_t  ngx_http_lua_request_body[] = {
+    { ngx_string("off"), NGX_HTTP_LUA_BODY_OFF },
+    { ngx_string("buffered"), NGX_HTTP_LUA_BODY_BUFFERED },
+    { ngx_string("stream"), NGX_HTTP_LUA_BODY_STREAM },
+    { ngx_null_string, 0 }
+};
 
 
 static ngx_command_t  ngx_http_lua_commands[] = {
@@ -48,6 +112,62 @@ static ngx_command_t  ngx_http_lua_commands[] = {
       0,
       NULL },
 
+    { ngx_string("lua_script_file"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_lua_script_file,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("lua_request_body"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_lua_loc_conf_t, request_body),
+      &ngx_http_lua_request_body },
+
+    { ngx_string("lua_rewrite"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_lua_phase_script,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_lua_loc_conf_t, rewrite_ref),
+      &ngx_http_lua_request_prefix },
+
+    { ngx_string("lua_access"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_lua_phase_script,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_lua_loc_conf_t, access_ref),
+      &ngx_http_lua_request_prefix },
+
+    { ngx_string("lua_header_filter"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_lua_phase_script,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_lua_loc_conf_t, header_filter_ref),
+      &ngx_http_lua_request_prefix },
+
+    { ngx_string("lua_body_filter"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_lua_phase_script,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_lua_loc_conf_t, body_filter_ref),
+      &ngx_http_lua_body_filter_prefix },
+
+    { ngx_string("lua_log"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_lua_phase_script,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_lua_loc_conf_t, log_ref),
+      &ngx_http_lua_request_prefix },
+
+    { ngx_string("lua_code_cache_check_interval"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_lua_main_conf_t, check_interval),
+      NULL },
+
     { ngx_string("lua_timer"),
       NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
       ngx_http_lua_timer,
@@ -62,6 +182,34 @@ static ngx_command_t  ngx_http_lua_commands[] = {
       0,
       NULL },
 
+    { ngx_string("lua_bytecode_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_lua_bytecode_cache,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("lua_thread_pool_size"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_lua_main_conf_t, thread_pool_size),
+      NULL },
+
+    { ngx_string("lua_ctx_recycle"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_lua_main_conf_t, ctx_recycle),
+      NULL },
+
+    { ngx_string("lua_var_index"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+      ngx_http_lua_var_index,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
     ngx_null_command
 };
 
@@ -71,7 +219,7 @@ static ngx_http_module_t  ngx_http_lua_module_ctx = {
     ngx_http_lua_init,             /* postconfiguration */
 
     ngx_http_lua_create_main_conf, /* create main configuration */
-    NULL,                          /* init main configuration */
+    ngx_http_lua_init_main_conf,   /* init main configuration */
 
     NULL,                          /* create server configuration */
     NULL,                          /* merge server configuration */
@@ -97,6 +245,10 @@ ngx_module_t  ngx_http_lua_module = {
 };
 
 
+static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
+static ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
+
+
 static ngx_int_t
 ngx_http_lua_init_process(ngx_cycle_t *cycle)
 {
@@ -131,362 +283,1512 @@ ngx_http_lua_init_process(ngx_cycle_t *cycle)
 }
 
 
-static void
-ngx_http_lua_body_handler(ngx_http_request_t *r)
+static ngx_http_lua_ctx_t *
+ngx_http_lua_get_ctx(ngx_http_request_t *r)
 {
-    ngx_int_t                 ret;
-    ngx_lua_t                 *lua;
-    ngx_http_cleanup_t        *cln;
-    ngx_http_lua_ctx_t        *ctx;
-    ngx_http_lua_loc_conf_t   *llcf;
-    ngx_http_lua_main_conf_t  *lmcf;
-    ngx_http_complex_value_t  cv;
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http lua body handler");
-
-    lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
-    llcf = ngx_http_get_module_loc_conf(r, ngx_http_lua_module);
+    ngx_pool_cleanup_t  *pcln;
+    ngx_http_cleanup_t  *cln;
+    ngx_http_lua_ctx_t  *ctx;
 
     ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
 
     if (ctx != NULL) {
-        lua = ctx->lua;
-        goto resume;
+        return ctx;
     }
 
     ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_lua_ctx_t));
     if (ctx == NULL) {
-        goto fail;
+        return NULL;
+    }
+
+    cln = ngx_http_cleanup_add(r, 0);
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    cln->handler = ngx_http_lua_cleanup;
+    cln->data = ctx;
+
+    /* r.ctx and the property cache outlive the log phase */
+
+    pcln = ngx_pool_cleanup_add(r->pool, 0);
+    if (pcln == NULL) {
+        return NULL;
     }
 
+    pcln->handler = ngx_http_lua_ctx_cleanup;
+    pcln->data = ctx;
+
+    ctx->last_out = &ctx->out;
+
+    ctx->resume.handler = ngx_http_lua_resume_handler;
+    ctx->resume.data = r;
+    ctx->resume.log = r->connection->log;
+
     ngx_http_set_ctx(r, ctx, ngx_http_lua_module);
 
+    return ctx;
+}
+
+
+static ngx_int_t
+ngx_http_lua_start(ngx_http_request_t *r, ngx_http_lua_ctx_t *ctx,
+    ngx_uint_t phase)
+{
+    ngx_lua_t                 *lua;
+    ngx_http_lua_loc_conf_t   *llcf;
+    ngx_http_lua_main_conf_t  *lmcf;
+
+    lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
+    llcf = ngx_http_get_module_loc_conf(r, ngx_http_lua_module);
+
     lua = ngx_lua_clone(lmcf->lua, r->pool);
     if (lua == NULL) {
-        goto fail;
+        return NGX_ERROR;
     }
 
     lua->log = r->connection->log;
     lua->data = r;
 
     ctx->lua = lua;
+    ctx->phase = phase;
 
-    cln = ngx_http_cleanup_add(r, 0);
-    if (cln == NULL) {
-        goto fail;
-    }
+    switch (phase) {
 
-    cln->handler = ngx_http_lua_cleanup;
-    cln->data = ctx;
+    case NGX_HTTP_LUA_REWRITE:
+        lua_rawgeti(lua->state, LUA_REGISTRYINDEX, llcf->rewrite_ref);
+        break;
+
+    case NGX_HTTP_LUA_ACCESS:
+        lua_rawgeti(lua->state, LUA_REGISTRYINDEX, llcf->access_ref);
+        break;
+
+    default: /* NGX_HTTP_LUA_CONTENT */
+
+        if (llcf->file != NULL) {
+            if (ngx_http_lua_file_load(lmcf, llcf->file, r->connection->log)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            lua_rawgeti(lua->state, LUA_REGISTRYINDEX, llcf->file->ref);
+
+        } else {
+            lua_rawgeti(lua->state, LUA_REGISTRYINDEX, llcf->lua_ref);
+        }
+    }
 
-    lua_rawgeti(lua->state, LUA_REGISTRYINDEX, llcf->lua_ref);
     lua_rawgeti(lua->state, LUA_REGISTRYINDEX, lmcf->request_ref);
 
-resume:
+    return ngx_lua_call(lua, 1, &ctx->resume);
+}
 
-    ret = ngx_lua_call(lua, 1, r->connection->write);
-    if (ret == NGX_ERROR) {
-        goto fail;
+
+static ngx_int_t
+ngx_http_lua_finish(ngx_http_request_t *r, ngx_http_lua_ctx_t *ctx,
+    ngx_int_t ret)
+{
+    ngx_http_lua_main_conf_t  *lmcf;
+
+    if (ret == NGX_AGAIN && !ctx->exited) {
+        return NGX_AGAIN;
     }
 
-    if (r->header_sent) {
-        ngx_http_finalize_request(r, NGX_DONE);
-        return;
+    lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
+
+    if (ctx->lua != NULL) {
+        ngx_lua_free(lmcf->lua->state, ctx->lua);
+        ctx->lua = NULL;
     }
 
-    if (ctx->status > 0 || ctx->buf != NULL) {
+    ctx->done |= ctx->phase;
 
-        if (ctx->status == 0) {
-            ctx->status = NGX_HTTP_OK;
-        }
+    if (ret == NGX_ERROR) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
 
-        ngx_memzero(&cv, sizeof(ngx_http_complex_value_t));
+    if (r->header_sent || ctx->exited || ctx->out != NULL) {
+        return ngx_http_lua_send_response(r, ctx);
+    }
 
-        if (ctx->buf != NULL) {
-            cv.value.data = ctx->buf->pos;
-            cv.value.len = ngx_buf_size(ctx->buf);
-        }
+    return NGX_DECLINED;
+}
 
-        ret = ctx->status;
 
-        if (ret < NGX_HTTP_BAD_REQUEST) {
-            ret = ngx_http_send_response(r, ctx->status, NULL, &cv);
-            if (ret == NGX_ERROR) {
-                goto fail;
-            }
-        }
+static void
+ngx_http_lua_next(ngx_http_request_t *r, ngx_http_lua_ctx_t *ctx,
+    ngx_int_t ret)
+{
+    ngx_int_t  rc;
+
+    rc = ngx_http_lua_finish(r, ctx, ret);
 
-        ngx_http_finalize_request(r, ret);
+    if (rc == NGX_AGAIN) {
         return;
     }
 
-    if (ret == NGX_AGAIN) {
+    if (rc == NGX_DECLINED) {
+        r->write_event_handler = ngx_http_core_run_phases;
+        ngx_http_core_run_phases(r);
         return;
     }
 
-    r->write_event_handler = ngx_http_core_run_phases;
-    ngx_http_core_run_phases(r);
+    ngx_http_finalize_request(r, rc);
+}
+
+
+static void
+ngx_http_lua_body_handler(ngx_http_request_t *r)
+{
+    ngx_int_t           ret;
+    ngx_http_lua_ctx_t  *ctx;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http lua body handler");
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
+    ret = ngx_http_lua_start(r, ctx, NGX_HTTP_LUA_CONTENT);
+
+    ngx_http_lua_next(r, ctx, ret);
+}
+
+
+static ngx_int_t
+ngx_http_lua_send_response(ngx_http_request_t *r, ngx_http_lua_ctx_t *ctx)
+{
+    ngx_int_t                 rc;
+    ngx_http_lua_main_conf_t  *lmcf;
+
+    lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
+
+    /* the script is done with a streamed body it did not start reading */
+
+    if (ctx->stream && ngx_http_discard_request_body(r) != NGX_OK) {
+        r->keepalive = 0;
+    }
+
+    if (!r->header_sent) {
 
-    return;
+        if (ctx->status >= NGX_HTTP_BAD_REQUEST) {
+            return ctx->status;
+        }
+
+        rc = ngx_lua_response_send_header(r, ctx, 1);
+        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+            return rc;
+        }
+    }
+
+    return ngx_lua_response_output(lmcf->lua->state, r, ctx, NGX_HTTP_LAST);
+}
+
+
+static void
+ngx_http_lua_resume_handler(ngx_event_t *ev)
+{
+    ngx_int_t           ret;
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+    ngx_http_lua_ctx_t  *ctx;
+
+    r = ev->data;
+    c = r->connection;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http lua resume handler");
 
-fail:
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
+    ret = ngx_lua_call(ctx->lua, 0, &ctx->resume);
 
-    ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    ngx_http_lua_next(r, ctx, ret);
+    ngx_http_run_posted_requests(c);
 }
 
 
 static void
 ngx_http_lua_cleanup(void *data)
 {
-    ngx_lua_t                 *lua;
     ngx_http_request_t        *r;
     ngx_http_lua_ctx_t        *ctx;
     ngx_http_lua_main_conf_t  *lmcf;
 
     ctx = data;
-    lua = ctx->lua;
-    r = lua->data;
+    r = ctx->resume.data;
 
     lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http lua cleanup");
 
-    ngx_lua_free(lmcf->lua->state, lua);
+    if (ctx->pins_ref != 0) {
+        luaL_unref(lmcf->lua->state, LUA_REGISTRYINDEX, ctx->pins_ref);
+        ctx->pins_ref = 0;
+    }
+
+    if (ctx->lua != NULL) {
+        ngx_lua_free(lmcf->lua->state, ctx->lua);
+    }
+
+    if (ctx->filter != NULL) {
+        ngx_lua_free(lmcf->lua->state, ctx->filter);
+        ctx->filter = NULL;
+    }
+}
+
+
+static void
+ngx_http_lua_ctx_cleanup(void *data)
+{
+    lua_State                 *L;
+    ngx_http_request_t        *r;
+    ngx_http_lua_ctx_t        *ctx;
+    ngx_http_lua_main_conf_t  *lmcf;
+
+    ctx = data;
+    r = ctx->resume.data;
+
+    lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
+    L = lmcf->lua->state;
+
+    if (ctx->cache_ref != 0) {
+        luaL_unref(L, LUA_REGISTRYINDEX, ctx->cache_ref);
+        ctx->cache_ref = 0;
+    }
+
+    if (ctx->ctx_ref != 0) {
+        ngx_lua_table_put(L, lmcf->lua->tables, ctx->ctx_ref);
+        ctx->ctx_ref = 0;
+    }
+}
+
+
+static ngx_int_t
+ngx_http_lua_phase_handler(ngx_http_request_t *r, ngx_uint_t phase)
+{
+    ngx_int_t           rc;
+    ngx_http_lua_ctx_t  *ctx;
+
+    ctx = ngx_http_lua_get_ctx(r);
+    if (ctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (ctx->done & phase) {
+        return NGX_DECLINED;
+    }
+
+    if (ctx->lua != NULL) {
+        /* the script is suspended and will be resumed by its own event */
+        return NGX_DONE;
+    }
+
+    rc = ngx_http_lua_finish(r, ctx, ngx_http_lua_start(r, ctx, phase));
+
+    if (rc == NGX_AGAIN) {
+        return NGX_DONE;
+    }
+
+    if (rc == NGX_DECLINED) {
+        return NGX_DECLINED;
+    }
+
+    ngx_http_finalize_request(r, rc);
+
+    return NGX_DONE;
+}
+
+
+static ngx_int_t
+ngx_http_lua_rewrite_handler(ngx_http_request_t *r)
+{
+    ngx_http_lua_loc_conf_t  *llcf;
+
+    llcf = ngx_http_get_module_loc_conf(r, ngx_http_lua_module);
+
+    if (llcf->rewrite_ref == 0) {
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http lua rewrite handler");
+
+    return ngx_http_lua_phase_handler(r, NGX_HTTP_LUA_REWRITE);
+}
+
+
+static ngx_int_t
+ngx_http_lua_access_handler(ngx_http_request_t *r)
+{
+    ngx_http_lua_loc_conf_t  *llcf;
+
+    llcf = ngx_http_get_module_loc_conf(r, ngx_http_lua_module);
+
+    if (llcf->access_ref == 0) {
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http lua access handler");
+
+    return ngx_http_lua_phase_handler(r, NGX_HTTP_LUA_ACCESS);
 }
 
 
 static ngx_int_t
 ngx_http_lua_handler(ngx_http_request_t *r)
 {
-    int                      status;
     ngx_int_t                ret;
     ngx_http_lua_ctx_t       *ctx;
     ngx_http_lua_loc_conf_t  *llcf;
 
+    llcf = ngx_http_get_module_loc_conf(r, ngx_http_lua_module);
+
+    if (llcf->lua_ref == 0 && llcf->file == NULL) {
+        return NGX_DECLINED;
+    }
+
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http lua handler");
 
-    llcf = ngx_http_get_module_loc_conf(r, ngx_http_lua_module);
+    ctx = ngx_http_lua_get_ctx(r);
+    if (ctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
 
-    if (llcf->lua_ref == 0) {
+    if (ctx->done & NGX_HTTP_LUA_CONTENT) {
         return NGX_DECLINED;
     }
 
-    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (ctx->lua != NULL) {
+        return NGX_DONE;
+    }
+
+    if (llcf->request_body == NGX_HTTP_LUA_BODY_BUFFERED) {
+        ret = ngx_http_read_client_request_body(r, ngx_http_lua_body_handler);
+        if (ret >= NGX_HTTP_SPECIAL_RESPONSE) {
+            return ret;
+        }
+
+    } else {
+
+        /* the body is left to r.read_body_chunk() or discarded */
+
+        ctx->stream = (llcf->request_body == NGX_HTTP_LUA_BODY_STREAM);
+
+        r->main->count++;
+        ngx_http_lua_body_handler(r);
+    }
+
+    ngx_http_finalize_request(r, NGX_DONE);
+
+    return NGX_DONE;
+}
+
+
+static ngx_lua_t *
+ngx_http_lua_filter_start(ngx_http_request_t *r, int ref)
+{
+    ngx_lua_t                 *lua;
+    ngx_http_lua_main_conf_t  *lmcf;
+
+    lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
+
+    /* filters and the log script share r.ctx with the phase scripts */
+
+    if (ngx_http_lua_get_ctx(r) == NULL) {
+        return NULL;
+    }
+
+    lua = ngx_lua_clone(lmcf->lua, r->pool);
+    if (lua == NULL) {
+        return NULL;
+    }
+
+    lua->log = r->connection->log;
+    lua->data = r;
+
+    lua_rawgeti(lua->state, LUA_REGISTRYINDEX, ref);
+    lua_rawgeti(lua->state, LUA_REGISTRYINDEX, lmcf->request_ref);
+
+    return lua;
+}
+
+
+static ngx_int_t
+ngx_http_lua_filter_call(ngx_http_request_t *r, ngx_lua_t *lua, int nargs,
+    int nresults)
+{
+    /* filter scripts run to completion, they cannot yield */
+
+    if (lua_pcall(lua->state, nargs + 1, nresults, 0) != LUA_OK) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "lua exception: %s", lua_tostring(lua->state, -1));
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_lua_filter_finish(ngx_http_request_t *r, ngx_lua_t *lua)
+{
+    ngx_http_lua_main_conf_t  *lmcf;
+
+    lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
+
+    ngx_lua_free(lmcf->lua->state, lua);
+}
+
+
+static ngx_int_t
+ngx_http_lua_header_filter(ngx_http_request_t *r)
+{
+    ngx_int_t                rc;
+    ngx_lua_t                *lua;
+    ngx_http_lua_loc_conf_t  *llcf;
+
+    llcf = ngx_http_get_module_loc_conf(r, ngx_http_lua_module);
+
+    if (llcf->body_filter_ref != 0) {
+        ngx_http_clear_content_length(r);
+        ngx_http_clear_accept_ranges(r);
+
+        r->filter_need_in_memory = 1;
+    }
+
+    if (llcf->header_filter_ref == 0) {
+        return ngx_http_next_header_filter(r);
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http lua header filter");
+
+    lua = ngx_http_lua_filter_start(r, llcf->header_filter_ref);
+    if (lua == NULL) {
+        return NGX_ERROR;
+    }
+
+    rc = ngx_http_lua_filter_call(r, lua, 0, 0);
+
+    ngx_http_lua_filter_finish(r, lua);
+
+    if (rc != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return ngx_http_next_header_filter(r);
+}
+
+
+static ngx_int_t
+ngx_http_lua_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
+{
+    u_char                    *start;
+    size_t                    size;
+    ngx_int_t                 rc;
+    ngx_str_t                 chunk;
+    ngx_buf_t                 *b;
+    lua_State                 *L;
+    ngx_uint_t                eof, flush;
+    luaL_Buffer               buf;
+    ngx_chain_t               *cl, *out;
+    ngx_http_lua_ctx_t        *ctx;
+    ngx_http_lua_loc_conf_t   *llcf;
+    ngx_http_lua_main_conf_t  *lmcf;
+
+    llcf = ngx_http_get_module_loc_conf(r, ngx_http_lua_module);
+
+    if (in == NULL || llcf->body_filter_ref == 0) {
+        return ngx_http_next_body_filter(r, in);
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http lua body filter");
+
+    size = 0;
+    eof = 0;
+    flush = 0;
+
+    for (cl = in; cl; cl = cl->next) {
+        b = cl->buf;
+
+        if (!ngx_buf_in_memory(b) && !ngx_buf_special(b)) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                          "lua body filter got a buffer not in memory");
+            return NGX_ERROR;
+        }
+
+        size += ngx_buf_in_memory(b) ? b->last - b->pos : 0;
+
+        if (b->last_buf || b->last_in_chain) {
+            eof = 1;
+        }
+
+        if (b->flush) {
+            flush = 1;
+        }
+    }
+
+    lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
+
+    ctx = ngx_http_lua_get_ctx(r);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* one coroutine runs the script for every chunk of the response */
+
+    if (ctx->filter == NULL) {
+        ctx->filter = ngx_lua_clone(lmcf->lua, r->pool);
+        if (ctx->filter == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->filter->log = r->connection->log;
+        ctx->filter->data = r;
+    }
+
+    L = ctx->filter->state;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, llcf->body_filter_ref);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lmcf->request_ref);
+
+    /* the script sees the whole chain as one string */
+
+    if (in->next == NULL && ngx_buf_in_memory(in->buf)) {
+        lua_pushlstring(L, (const char *) in->buf->pos, size);
+
+    } else {
+        luaL_buffinitsize(L, &buf, size);
+
+        for (cl = in; cl; cl = cl->next) {
+            if (ngx_buf_in_memory(cl->buf)) {
+                luaL_addlstring(&buf, (const char *) cl->buf->pos,
+                                cl->buf->last - cl->buf->pos);
+            }
+        }
+
+        luaL_pushresult(&buf);
+    }
+
+    lua_pushboolean(L, eof);
+
+    if (ngx_http_lua_filter_call(r, ctx->filter, 2, 1) != NGX_OK) {
+        lua_settop(L, 0);
+        return NGX_ERROR;
+    }
+
+    if (!lua_isstring(L, -1)) {
+        lua_settop(L, 0);
+        return ngx_http_next_body_filter(r, in);
+    }
+
+    /* the returned string replaces the chunk */
+
+    chunk.data = (u_char *) lua_tolstring(L, -1, &chunk.len);
+
+    for (cl = in; cl; cl = cl->next) {
+        cl->buf->pos = cl->buf->last;
+        cl->buf->file_pos = cl->buf->file_last;
+    }
+
+    if (chunk.len == 0 && !eof && !flush) {
+        lua_settop(L, 0);
+        return NGX_OK;
+    }
+
+    /* sent buffers are recycled, so memory does not grow with the body */
+
+    cl = ngx_chain_get_free_buf(r->pool, &ctx->filter_free);
+    if (cl == NULL) {
+        lua_settop(L, 0);
+        return NGX_ERROR;
+    }
+
+    b = cl->buf;
+
+    start = b->start;
+    size = b->end - b->start;
+
+    ngx_memzero(b, sizeof(ngx_buf_t));
+
+    if (chunk.len > size) {
+        if (start != NULL) {
+            (void) ngx_pfree(r->pool, start);
+        }
+
+        size = chunk.len;
+
+        start = ngx_palloc(r->pool, size);
+        if (start == NULL) {
+            lua_settop(L, 0);
+            return NGX_ERROR;
+        }
+    }
+
+    if (start != NULL) {
+        b->start = start;
+        b->end = start + size;
+        b->pos = start;
+        b->last = ngx_cpymem(start, chunk.data, chunk.len);
+        b->temporary = (chunk.len > 0);
+    }
+
+    lua_settop(L, 0);
+
+    b->tag = (ngx_buf_tag_t) &ngx_http_lua_module;
+    b->last_buf = (eof && r == r->main) ? 1 : 0;
+    b->last_in_chain = eof;
+    b->flush = flush;
+
+    if (chunk.len == 0 && !b->last_buf && !b->flush) {
+        b->sync = 1;
+    }
+
+    out = cl;
+
+    rc = ngx_http_next_body_filter(r, out);
+
+    ngx_chain_update_chains(r->pool, &ctx->filter_free, &ctx->filter_busy,
+                            &out, (ngx_buf_tag_t) &ngx_http_lua_module);
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_lua_log_handler(ngx_http_request_t *r)
+{
+    ngx_lua_t                *lua;
+    ngx_http_lua_loc_conf_t  *llcf;
+
+    llcf = ngx_http_get_module_loc_conf(r, ngx_http_lua_module);
+
+    if (llcf->log_ref == 0) {
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http lua log handler");
+
+    lua = ngx_http_lua_filter_start(r, llcf->log_ref);
+    if (lua == NULL) {
+        return NGX_ERROR;
+    }
+
+    (void) ngx_http_lua_filter_call(r, lua, 0, 0);
+
+    ngx_http_lua_filter_finish(r, lua);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_lua_timer_handler(ngx_event_t *ev)
+{
+    ngx_int_t                 ret;
+    ngx_lua_conf_t            *conf;
+    ngx_lua_timer_t           *timer;
+    ngx_http_lua_main_conf_t  *lmcf;
+
+    lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_lua_module);
+
+    timer = ev->data;
+
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, timer->log, 0, "lua timer handler");
+
+    conf = timer->conf;
+
+    if (conf != NULL) {
+        goto resume;
+    }
+
+    conf = ngx_lua_conf_new(lmcf->lua, timer->log);
+    if (conf == NULL) {
+        goto clean;
+    }
+
+    lua_rawgeti(conf->lua->state, LUA_REGISTRYINDEX, timer->ref);
+    lua_rawgeti(conf->lua->state, LUA_REGISTRYINDEX, conf->conf_ref);
+
+resume:
+
+    ret = ngx_lua_call(conf->lua, 1, &timer->event);
+    if (ret == NGX_AGAIN) {
+        /* the same event resumes the suspended run */
+        timer->conf = conf;
+        return;
+    }
+
+    timer->conf = NULL;
+
+    if (ret == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, timer->log, 0, "timer handler failed");
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, timer->log, 0,
+                   "lua timer call: ret: %i", ret);
+
+    luaL_unref(lmcf->lua->state, LUA_REGISTRYINDEX, conf->conf_ref);
+
+    /* TODO */
+    lua_gc(lmcf->lua->state, LUA_GCCOLLECT, 0);
+
+clean:
+
+    ngx_add_timer(&timer->event, timer->interval);
+}
+
+
+static void *
+ngx_http_lua_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_lua_t                 *lua;
+    ngx_http_lua_main_conf_t  *lmcf;
+
+    lmcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_lua_main_conf_t));
+    if (lmcf == NULL) {
+        return NULL;
+    }
+
+    lua = ngx_lua_create(cf->pool);
+    if (lua == NULL) {
+        return NULL;
+    }
+
+    ngx_lua_nginx_register(lua->state);
+
+    /* lua http register */
+    ngx_lua_request_metatable(lua->state);
+    ngx_lua_headers_metatable(lua->state);
+    ngx_lua_response_metatable(lua->state);
+    ngx_lua_body_metatable(lua->state);
+    ngx_lua_multipart_metatable(lua->state);
+
+    lmcf->lua = lua;
+    lmcf->request_ref = ngx_lua_http_request_object(lua->state);
+
+    lmcf->dicts = ngx_array_create(cf->pool, 4, sizeof(ngx_lua_dict_t));
+    if (lmcf->dicts == NULL) {
+        return NULL;
+    }
 
-    if (ctx != NULL) {
-        status = lua_status(ctx->lua->state);
-        if (status == LUA_OK) {
+    lmcf->timers = ngx_array_create(cf->pool, 4, sizeof(ngx_lua_timer_t));
+    if (lmcf->timers == NULL) {
+        return NULL;
+    }
+
+    ngx_rbtree_init(&lmcf->chunks, &lmcf->chunks_sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    lmcf->files = ngx_array_create(cf->pool, 4,
+                                   sizeof(ngx_http_lua_file_t *));
+    if (lmcf->files == NULL) {
+        return NULL;
+    }
+
+    lmcf->thread_pool_size = NGX_CONF_UNSET_UINT;
+    lmcf->ctx_recycle = NGX_CONF_UNSET;
+    lmcf->check_interval = NGX_CONF_UNSET;
+
+    return lmcf;
+}
+
+
+static char *
+ngx_http_lua_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_http_lua_main_conf_t *lmcf = conf;
+
+    ngx_conf_init_uint_value(lmcf->thread_pool_size, 128);
+    ngx_conf_init_value(lmcf->ctx_recycle, 0);
+    ngx_conf_init_value(lmcf->check_interval, 0);
+
+    if (lmcf->thread_pool_size == 0) {
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_lua_threads_init(lmcf->lua, cf->pool, lmcf->thread_pool_size)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    /*
+     * r.ctx tables may be recycled the same way, but only on request:
+     * a table a script keeps past its request sees the next one's data
+     */
+
+    if (!lmcf->ctx_recycle) {
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_lua_tables_init(lmcf->lua, cf->pool, lmcf->thread_pool_size)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static void *
+ngx_http_lua_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_lua_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_lua_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->lua_ref = 0;
+     *     conf->file = NULL;
+     *     conf->rewrite_ref = 0;
+     *     conf->access_ref = 0;
+     *     conf->header_filter_ref = 0;
+     *     conf->body_filter_ref = 0;
+     *     conf->log_ref = 0;
+     */
+
+    conf->request_body = NGX_CONF_UNSET_UINT;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_lua_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_lua_loc_conf_t  *prev = parent;
+    ngx_http_lua_loc_conf_t  *conf = child;
+
+    if (conf->lua_ref == 0 && conf->file == NULL) {
+        conf->lua_ref = prev->lua_ref;
+        conf->file = prev->file;
+    }
+
+    if (conf->rewrite_ref == 0) {
+        conf->rewrite_ref = prev->rewrite_ref;
+    }
+
+    if (conf->access_ref == 0) {
+        conf->access_ref = prev->access_ref;
+    }
+
+    if (conf->header_filter_ref == 0) {
+        conf->header_filter_ref = prev->header_filter_ref;
+    }
+
+    if (conf->body_filter_ref == 0) {
+        conf->body_filter_ref = prev->body_filter_ref;
+    }
+
+    if (conf->log_ref == 0) {
+        conf->log_ref = prev->log_ref;
+    }
+
+    ngx_conf_merge_uint_value(conf->request_body, prev->request_body,
+                              NGX_HTTP_LUA_BODY_BUFFERED);
+
+    return NGX_CONF_OK;
+}
+
+
+static const char *
+ngx_http_lua_reader(lua_State *L, void *ud, size_t *size)
+{
+    u_char                *p;
+    ngx_str_t             *s;
+    ngx_http_lua_parse_t  *parse;
+
+    parse = ud;
+
+    if (parse->prefix.len != 0) {
+        s = &parse->prefix;
+
+    } else if (parse->script.len != 0) {
+        s = &parse->script;
+
+    } else {
+        return NULL;
+    }
+
+    p = s->data;
+    *size = s->len;
+
+    s->len = 0;
+
+    return (const char *) p;
+}
+
+
+static int
+ngx_http_lua_writer(lua_State *L, const void *p, size_t size, void *ud)
+{
+    ngx_chb_t  *chb = ud;
+
+    ngx_chb_add_string(chb, (u_char *) p, size);
+
+    return chb->error;
+}
+
+
+static ngx_int_t
+ngx_http_lua_cache_name(ngx_conf_t *cf, ngx_str_t *dir, ngx_str_t *prefix,
+    ngx_str_t *script, ngx_str_t *name)
+{
+    u_char     *p, hash[16];
+    ngx_md5_t  md5;
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, LUA_RELEASE, sizeof(LUA_RELEASE));
+    ngx_md5_update(&md5, prefix->data, prefix->len);
+    ngx_md5_update(&md5, script->data, script->len);
+    ngx_md5_final(hash, &md5);
+
+    name->len = dir->len + 1 + 32 + sizeof(".luac") - 1;
+
+    name->data = ngx_pnalloc(cf->temp_pool, name->len + 1);
+    if (name->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(name->data, dir->data, dir->len);
+    *p++ = '/';
+    p = ngx_hex_dump(p, hash, 16);
+    p = ngx_cpymem(p, ".luac", sizeof(".luac") - 1);
+    *p = '\0';
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_http_lua_cache_unsafe(ngx_file_info_t *fi)
+{
+    return (fi->st_uid != geteuid()
+            || (ngx_file_access(fi) & (S_IWGRP|S_IWOTH)));
+}
+
+
+static ngx_int_t
+ngx_http_lua_cache_load(ngx_conf_t *cf, lua_State *L, ngx_str_t *name)
+{
+    int                   ret;
+    u_char                *buf;
+    size_t                size;
+    ssize_t               n;
+    ngx_file_t            file;
+    ngx_file_info_t       fi;
+    ngx_http_lua_parse_t  parse;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = *name;
+    file.log = cf->log;
+
+    file.fd = ngx_open_file(name->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (file.fd == NGX_INVALID_FILE) {
+        return NGX_DECLINED;
+    }
+
+    buf = NULL;
+    size = 0;
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, cf->log, ngx_errno,
+                      ngx_fd_info_n " \"%V\" failed", name);
+        goto close;
+    }
+
+    if (ngx_http_lua_cache_unsafe(&fi)) {
+        ngx_log_error(NGX_LOG_WARN, cf->log, 0,
+                      "ignoring lua bytecode cache \"%V\": "
+                      "unsafe owner or permissions", name);
+        goto close;
+    }
+
+    size = (size_t) ngx_file_size(&fi);
+
+    buf = ngx_pnalloc(cf->temp_pool, size);
+    if (buf == NULL) {
+        goto close;
+    }
+
+    n = ngx_read_file(&file, buf, size, 0);
+
+    if (n != (ssize_t) size) {
+        buf = NULL;
+    }
+
+close:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, cf->log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", name);
+    }
+
+    if (buf == NULL) {
+        return NGX_DECLINED;
+    }
+
+    ngx_str_null(&parse.prefix);
+    parse.script.data = buf;
+    parse.script.len = size;
+
+    ret = lua_load(L, ngx_http_lua_reader, &parse, NULL, "b");
+
+    if (ret != LUA_OK) {
+        ngx_log_error(NGX_LOG_WARN, cf->log, 0,
+                      "ignoring lua bytecode cache \"%V\": %s",
+                      name, lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_lua_cache_save(ngx_conf_t *cf, lua_State *L, ngx_str_t *name)
+{
+    u_char          *p;
+    size_t          size;
+    ssize_t         n;
+    ngx_fd_t        fd;
+    ngx_str_t       temp;
+    ngx_chb_t       chb;
+    ngx_chb_node_t  *node;
+
+    ngx_chb_init(&chb, cf->temp_pool);
+
+    if (lua_dump(L, ngx_http_lua_writer, &chb, 0) != 0) {
+        return;
+    }
+
+    temp.len = name->len + sizeof(".tmp") - 1;
+
+    temp.data = ngx_pnalloc(cf->temp_pool, temp.len + 1);
+    if (temp.data == NULL) {
+        return;
+    }
+
+    p = ngx_cpymem(temp.data, name->data, name->len);
+    p = ngx_cpymem(p, ".tmp", sizeof(".tmp") - 1);
+    *p = '\0';
+
+    fd = ngx_open_file(temp.data, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                       NGX_FILE_DEFAULT_ACCESS);
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_WARN, cf->log, ngx_errno,
+                      ngx_open_file_n " \"%V\" failed", &temp);
+        return;
+    }
+
+    for (node = chb.nodes; node != NULL; node = node->next) {
+        size = ngx_chb_node_used(node);
+
+        n = ngx_write_fd(fd, node->start, size);
+
+        if (n != (ssize_t) size) {
+            ngx_log_error(NGX_LOG_WARN, cf->log, ngx_errno,
+                          ngx_write_fd_n " \"%V\" failed", &temp);
+            break;
+        }
+    }
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, cf->log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &temp);
+    }
+
+    if (node != NULL) {
+        (void) ngx_delete_file(temp.data);
+        return;
+    }
+
+    if (ngx_rename_file(temp.data, name->data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_WARN, cf->log, ngx_errno,
+                      ngx_rename_file_n " \"%V\" to \"%V\" failed",
+                      &temp, name);
+        (void) ngx_delete_file(temp.data);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_lua_compile(ngx_conf_t *cf, ngx_str_t *prefix, ngx_str_t *script)
+{
+    int                       ret;
+    ngx_str_t                 name;
+    lua_State                 *L;
+    ngx_http_lua_parse_t      parse;
+    ngx_http_lua_main_conf_t  *lmcf;
+
+    lmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_lua_module);
+    L = lmcf->lua->state;
+
+    if (lmcf->bytecode_cache.len != 0) {
+        if (ngx_http_lua_cache_name(cf, &lmcf->bytecode_cache, prefix, script,
+                                    &name)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        if (ngx_http_lua_cache_load(cf, L, &name) == NGX_OK) {
+            lmcf->bytecode_hits++;
             return NGX_OK;
         }
+
+        lmcf->bytecode_misses++;
+    }
+
+    parse.prefix = *prefix;
+    parse.script = *script;
+
+    ret = lua_load(L, ngx_http_lua_reader, &parse, NULL, "t");
+
+    if (ret != LUA_OK) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "lua_load() failed: %s",
+                           lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return NGX_ERROR;
+    }
+
+    if (lmcf->bytecode_cache.len != 0) {
+        ngx_http_lua_cache_save(cf, L, &name);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_lua_load(ngx_conf_t *cf, ngx_str_t *prefix, ngx_str_t *script,
+    int *ref)
+{
+    u_char                    *p;
+    uint32_t                  hash;
+    ngx_str_t                 key;
+    ngx_http_lua_chunk_t      *chunk;
+    ngx_http_lua_main_conf_t  *lmcf;
+
+    lmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_lua_module);
+
+    /*
+     * Identical scripts with the same prefix share one compiled function,
+     * the chunks are interned by the prefix followed by the text.
+     */
+
+    key.len = prefix->len + script->len;
+
+    key.data = ngx_pnalloc(cf->pool, key.len);
+    if (key.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(key.data, prefix->data, prefix->len);
+    ngx_memcpy(p, script->data, script->len);
+
+    hash = ngx_crc32_long(key.data, key.len);
+
+    chunk = (ngx_http_lua_chunk_t *)
+                ngx_str_rbtree_lookup(&lmcf->chunks, &key, hash);
+
+    if (chunk != NULL) {
+        *ref = chunk->ref;
+        return NGX_OK;
+    }
+
+    if (ngx_http_lua_compile(cf, prefix, script) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    *ref = luaL_ref(lmcf->lua->state, LUA_REGISTRYINDEX);
+
+    chunk = ngx_palloc(cf->pool, sizeof(ngx_http_lua_chunk_t));
+    if (chunk == NULL) {
+        return NGX_ERROR;
+    }
+
+    chunk->sn.node.key = hash;
+    chunk->sn.str = key;
+    chunk->ref = *ref;
+
+    ngx_rbtree_insert(&lmcf->chunks, &chunk->sn.node);
+
+    return NGX_OK;
+}
+
+
+static char *
+ngx_http_lua_script(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_lua_loc_conf_t *llcf = conf;
+
+    ngx_str_t  *value;
+
+    if (llcf->lua_ref != 0 || llcf->file != NULL) {
+        return "is duplicate";
     }
 
-    ret = ngx_http_read_client_request_body(r, ngx_http_lua_body_handler);
-    if (ret >= NGX_HTTP_SPECIAL_RESPONSE) {
-        return ret;
+    value = cf->args->elts;
+
+    if (ngx_http_lua_load(cf, &ngx_http_lua_request_prefix, &value[1],
+                          &llcf->lua_ref)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
     }
 
-    ngx_http_finalize_request(r, NGX_DONE);
-
-    return NGX_DONE;
+    return NGX_CONF_OK;
 }
 
 
-static void
-ngx_lua_timer_handler(ngx_event_t *ev)
+static char *
+ngx_http_lua_phase_script(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_int_t                 ret;
-    ngx_lua_conf_t            *conf;
-    ngx_lua_timer_t           *timer;
-    ngx_http_lua_main_conf_t  *lmcf;
+    char  *p = conf;
 
-    lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_lua_module);
-
-    timer = ev->data;
+    int        *ref;
+    ngx_str_t  *value;
 
-    ngx_log_debug(NGX_LOG_DEBUG_HTTP, timer->log, 0, "lua timer handler");
+    ref = (int *) (p + cmd->offset);
 
-    conf = ngx_lua_conf_new(lmcf->lua, timer->log);
-    if (conf == NULL) {
-        goto clean;
+    if (*ref != 0) {
+        return "is duplicate";
     }
 
-    lua_rawgeti(conf->lua->state, LUA_REGISTRYINDEX, timer->ref);
-    lua_rawgeti(conf->lua->state, LUA_REGISTRYINDEX, conf->conf_ref);
+    value = cf->args->elts;
 
-    ret = ngx_lua_call(conf->lua, 1, &timer->event);
-    if (ret == NGX_ERROR) {
-        ngx_log_error(NGX_LOG_ERR, timer->log, 0, "timer handler failed");
+    if (ngx_http_lua_load(cf, cmd->post, &value[1], ref) != NGX_OK) {
+        return NGX_CONF_ERROR;
     }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, timer->log, 0,
-                   "lua timer call: ret: %i", ret);
-
-    luaL_unref(lmcf->lua->state, LUA_REGISTRYINDEX, conf->conf_ref);
-
-    /* TODO */
-    lua_gc(lmcf->lua->state, LUA_GCCOLLECT, 0);
-
-clean:
-
-    ngx_add_timer(&timer->event, timer->interval);
+    return NGX_CONF_OK;
 }
 
 
-static void *
-ngx_http_lua_create_main_conf(ngx_conf_t *cf)
+static char *
+ngx_http_lua_script_file(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_lua_t                 *lua;
+    ngx_http_lua_loc_conf_t *llcf = conf;
+
+    u_char                    *p;
+    ngx_str_t                 *value, name;
+    ngx_uint_t                i;
+    ngx_http_lua_file_t       *file, **files;
     ngx_http_lua_main_conf_t  *lmcf;
 
-    lmcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_lua_main_conf_t));
-    if (lmcf == NULL) {
-        return NULL;
+    if (llcf->lua_ref != 0 || llcf->file != NULL) {
+        return "is duplicate";
     }
 
-    lua = ngx_lua_create(cf->pool);
-    if (lua == NULL) {
-        return NULL;
+    lmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_lua_module);
+
+    value = cf->args->elts;
+
+    name = value[1];
+
+    if (ngx_conf_full_name(cf->cycle, &name, 1) != NGX_OK) {
+        return NGX_CONF_ERROR;
     }
 
-    ngx_lua_nginx_register(lua->state);
+    files = lmcf->files->elts;
 
-    /* lua http register */
-    ngx_lua_request_metatable(lua->state);
-    ngx_lua_headers_metatable(lua->state);
-    ngx_lua_response_metatable(lua->state);
+    for (i = 0; i < lmcf->files->nelts; i++) {
+        file = files[i];
 
-    lmcf->lua = lua;
-    lmcf->request_ref = ngx_lua_http_request_object(lua->state);
+        if (file->name.len == name.len
+            && ngx_strncmp(file->name.data, name.data, name.len) == 0)
+        {
+            llcf->file = file;
+            return NGX_CONF_OK;
+        }
+    }
 
-    lmcf->dicts = ngx_array_create(cf->pool, 4, sizeof(ngx_lua_dict_t));
-    if (lmcf->dicts == NULL) {
-        return NULL;
+    file = ngx_pcalloc(cf->pool, sizeof(ngx_http_lua_file_t));
+    if (file == NULL) {
+        return NGX_CONF_ERROR;
     }
 
-    lmcf->timers = ngx_array_create(cf->pool, 4, sizeof(ngx_lua_timer_t));
-    if (lmcf->timers == NULL) {
-        return NULL;
+    file->name = name;
+
+    file->chunkname = ngx_pnalloc(cf->pool, name.len + 2);
+    if (file->chunkname == NULL) {
+        return NGX_CONF_ERROR;
     }
 
-    return lmcf;
-}
+    p = file->chunkname;
+    *p++ = '@';
+    p = ngx_cpymem(p, name.data, name.len);
+    *p = '\0';
+
+    files = ngx_array_push(lmcf->files);
+    if (files == NULL) {
+        return NGX_CONF_ERROR;
+    }
 
+    *files = file;
 
-static void *
-ngx_http_lua_create_loc_conf(ngx_conf_t *cf)
-{
-    ngx_http_lua_loc_conf_t  *conf;
+    /* a missing or broken file fails the configuration */
 
-    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_lua_loc_conf_t));
-    if (conf == NULL) {
-        return NULL;
+    if (ngx_http_lua_file_load(lmcf, file, cf->log) != NGX_OK) {
+        return NGX_CONF_ERROR;
     }
 
-    /*
-     * set by ngx_pcalloc():
-     *
-     *     conf->lua_ref = 0;
-     */
+    llcf->file = file;
 
-    return conf;
+    return NGX_CONF_OK;
 }
 
 
-static char *
-ngx_http_lua_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+static ngx_int_t
+ngx_http_lua_file_load(ngx_http_lua_main_conf_t *lmcf,
+    ngx_http_lua_file_t *file, ngx_log_t *log)
 {
-    ngx_http_lua_loc_conf_t  *prev = parent;
-    ngx_http_lua_loc_conf_t  *conf = child;
+    int                   ret;
+    u_char                *buf;
+    size_t                size;
+    ssize_t               n;
+    time_t                now;
+    lua_State             *L;
+    ngx_file_t            f;
+    ngx_file_info_t       fi;
+    ngx_http_lua_parse_t  parse;
+
+    now = ngx_time();
 
-    if (conf->lua_ref == 0) {
-        conf->lua_ref = prev->lua_ref;
-    }
+    /*
+     * The file is compiled at configuration time and inherited by
+     * the workers, which only look at it again to reload a changed one.
+     */
 
-    return NGX_CONF_OK;
-}
+    if (file->ref != 0) {
 
+        if (lmcf->check_interval == 0
+            || now - file->checked < lmcf->check_interval)
+        {
+            return NGX_OK;
+        }
 
-static const char *
-ngx_http_lua_reader(lua_State *L, void *ud, size_t *size)
-{
-    u_char                *buffer;
-    ngx_http_lua_parse_t  *parse;
+        file->checked = now;
 
-    parse = ud;
+        if (ngx_file_info(file->name.data, &fi) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                          ngx_file_info_n " \"%V\" failed", &file->name);
+            return NGX_OK;
+        }
 
-    if (parse->script.len == 0) {
-        return NULL;
+        if (ngx_file_mtime(&fi) == file->mtime) {
+            return NGX_OK;
+        }
     }
 
-    buffer = lua_newuserdata(L, parse->prefix.len + parse->script.len);
-    if (buffer == NULL) {
-        return NULL;
+    ngx_memzero(&f, sizeof(ngx_file_t));
+
+    f.name = file->name;
+    f.log = log;
+
+    f.fd = ngx_open_file(file->name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (f.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                      ngx_open_file_n " \"%V\" failed", &file->name);
+        goto failed;
     }
 
-    ngx_memcpy(buffer, parse->prefix.data, parse->prefix.len);
-    ngx_memcpy(buffer + parse->prefix.len, parse->script.data,
-               parse->script.len);
+    buf = NULL;
 
-    *size = parse->prefix.len + parse->script.len;
-    parse->script.len = 0;
+    if (ngx_fd_info(f.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                      ngx_fd_info_n " \"%V\" failed", &file->name);
+        goto close;
+    }
 
-    return (const char *) buffer;
-}
+    size = (size_t) ngx_file_size(&fi);
 
+    buf = ngx_alloc(size + 1, log);
+    if (buf == NULL) {
+        goto close;
+    }
 
-static char *
-ngx_http_lua_script(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
-{
-    ngx_http_lua_loc_conf_t *llcf = conf;
+    n = ngx_read_file(&f, buf, size, 0);
 
-    int                       ret;
-    ngx_str_t                 *value;
-    ngx_lua_t                 *lua;
-    ngx_http_lua_parse_t      parse;
-    ngx_http_lua_main_conf_t  *lmcf;
+    if (n != (ssize_t) size) {
+        ngx_free(buf);
+        buf = NULL;
+    }
 
-    if (llcf->lua_ref != 0) {
-        return "is duplicate";
+close:
+
+    if (ngx_close_file(f.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &file->name);
     }
 
-    lmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_lua_module);
-    lua = lmcf->lua;
+    if (buf == NULL) {
+        goto failed;
+    }
 
-    value = cf->args->elts;
+    L = lmcf->lua->state;
 
-    parse.script = value[1];
-    ngx_str_set(&parse.prefix, "local r = ...;");
+    parse.prefix = ngx_http_lua_request_prefix;
+    parse.script.data = buf;
+    parse.script.len = size;
 
-    ret = lua_load(lua->state, ngx_http_lua_reader, &parse, NULL, NULL);
+    ret = lua_load(L, ngx_http_lua_reader, &parse,
+                   (const char *) file->chunkname, "t");
+
+    ngx_free(buf);
 
     if (ret != LUA_OK) {
-        ngx_log_error(NGX_LOG_ERR, cf->log, 0, "lua_load() failed");
-        return NGX_CONF_ERROR;
+        ngx_log_error(NGX_LOG_ERR, log, 0, "lua_load() failed: %s",
+                      lua_tostring(L, -1));
+        lua_pop(L, 1);
+        goto failed;
     }
 
-    llcf->lua_ref = luaL_ref(lua->state, LUA_REGISTRYINDEX);
+    if (file->ref != 0) {
+        luaL_unref(L, LUA_REGISTRYINDEX, file->ref);
+    }
 
-    return NGX_CONF_OK;
+    file->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    file->mtime = ngx_file_mtime(&fi);
+    file->checked = now;
+
+    return NGX_OK;
+
+failed:
+
+    /* keep serving the previously loaded version */
+
+    return (file->ref != 0) ? NGX_OK : NGX_ERROR;
 }
 
 
 static char *
 ngx_http_lua_timer(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_int_t                 ret;
-    ngx_lua_t                 *lua;
+    int                       ref;
     ngx_str_t                 *value, s;
     ngx_msec_t                interval;
     ngx_uint_t                i;
     ngx_lua_timer_t           *timer;
-    ngx_http_lua_parse_t      parse;
     ngx_http_lua_main_conf_t  *lmcf;
 
     lmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_lua_module);
-    lua = lmcf->lua;
 
     value = cf->args->elts;
 
@@ -514,14 +1816,9 @@ invalid:
         return NGX_CONF_ERROR;
     }
 
-    parse.script = value[1];
-    ngx_str_set(&parse.prefix, "local conf = ...;");
-
-    ret = lua_load(lua->state, ngx_http_lua_reader, &parse, NULL, NULL);
-
-    if (ret != LUA_OK) {
-        ngx_log_error(NGX_LOG_ERR, cf->log, 0, "luaL_loadbuffer() failed: %s",
-                      lua_tostring(lua->state, -1));
+    if (ngx_http_lua_load(cf, &ngx_http_lua_timer_prefix, &value[1], &ref)
+        != NGX_OK)
+    {
         return NGX_CONF_ERROR;
     }
 
@@ -531,7 +1828,7 @@ invalid:
     }
 
     timer->interval = interval;
-    timer->ref = luaL_ref(lua->state, LUA_REGISTRYINDEX);
+    timer->ref = ref;
 
     return NGX_CONF_OK;
 }
@@ -544,12 +1841,15 @@ ngx_http_lua_dict_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     u_char          *p;
     ssize_t         size;
+    ngx_int_t       shards;
     ngx_str_t       *value, name, s;
-    ngx_uint_t      i;
+    ngx_uint_t      i, lockfree;
     ngx_lua_dict_t  *dict;
     ngx_shm_zone_t  *shm_zone;
 
     size = 0;
+    shards = 1;
+    lockfree = 0;
     name.len = 0;
 
     value = cf->args->elts;
@@ -594,6 +1894,28 @@ ngx_http_lua_dict_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
             continue;
         }
+
+        if (ngx_strncmp(value[i].data, "shards=", 7) == 0) {
+
+            shards = ngx_atoi(value[i].data + 7, value[i].len - 7);
+
+            if (shards < 1 || shards > NGX_LUA_DICT_MAX_SHARDS) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid shards value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "lockfree") == 0) {
+            lockfree = 1;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
     }
 
     if (name.len == 0) {
@@ -619,6 +1941,8 @@ ngx_http_lua_dict_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
 
     dict->shm_zone = shm_zone;
+    dict->nshards = shards;
+    dict->lockfree = lockfree;
 
     shm_zone->init = ngx_http_lua_dict_init_zone;
     shm_zone->data = dict;
@@ -627,17 +1951,111 @@ ngx_http_lua_dict_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 }
 
 
+static char *
+ngx_http_lua_bytecode_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_lua_main_conf_t  *lmcf = conf;
+
+    ngx_str_t        *value;
+    ngx_file_info_t  fi;
+
+    if (lmcf->bytecode_cache.data) {
+        return "is duplicate";
+    }
+
+    /* scripts are compiled as they are parsed */
+
+    if (lmcf->chunks.root != lmcf->chunks.sentinel) {
+        return "must be specified before lua scripts";
+    }
+
+    value = cf->args->elts;
+
+    lmcf->bytecode_cache = value[1];
+
+    if (ngx_conf_full_name(cf->cycle, &lmcf->bytecode_cache, 0) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_file_info(lmcf->bytecode_cache.data, &fi) == NGX_FILE_ERROR
+        || !ngx_is_dir(&fi))
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           "\"%V\" is not a directory",
+                           &lmcf->bytecode_cache);
+        return NGX_CONF_ERROR;
+    }
+
+    /* the cached chunks are loaded unverified, possibly as root */
+
+    if (ngx_http_lua_cache_unsafe(&fi)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must be owned by the nginx user and "
+                           "not writable by group or others",
+                           &lmcf->bytecode_cache);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_lua_var_index(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_str_t   *value, name;
+    ngx_uint_t  i;
+
+    value = cf->args->elts;
+
+    /* indexed now, the handles are handed out by ngx.var_index() */
+
+    for (i = 1; i < cf->args->nelts; i++) {
+        name = value[i];
+
+        if (name.len > 1 && name.data[0] == '$') {
+            name.len--;
+            name.data++;
+        }
+
+        if (ngx_http_get_variable_index(cf, &name) == NGX_ERROR) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+
 static ngx_int_t
 ngx_http_lua_dict_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 {
     ngx_lua_dict_t  *prev = data;
 
-    size_t          len;
-    ngx_lua_dict_t  *dict;
+    size_t                len;
+    ngx_uint_t            i;
+    ngx_lua_dict_t        *dict;
+    ngx_lua_dict_shard_t  *shard;
 
     dict = shm_zone->data;
 
     if (prev) {
+
+        if (prev->nshards != dict->nshards) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "lua shared dict zone \"%V\" uses %ui shards "
+                          "while previously it used %ui",
+                          &shm_zone->shm.name, dict->nshards, prev->nshards);
+            return NGX_ERROR;
+        }
+
+        if (prev->lockfree != dict->lockfree) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "lua shared dict zone \"%V\" cannot change "
+                          "its \"lockfree\" parameter", &shm_zone->shm.name);
+            return NGX_ERROR;
+        }
+
         dict->sh = prev->sh;
         dict->shpool = prev->shpool;
 
@@ -658,8 +2076,25 @@ ngx_http_lua_dict_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 
     dict->shpool->data = dict->sh;
 
-    ngx_rbtree_init(&dict->sh->rbtree, &dict->sh->sentinel,
-                    ngx_str_rbtree_insert_value);
+    len = dict->nshards * sizeof(ngx_lua_dict_shard_t);
+
+    dict->sh->shards = ngx_slab_calloc(dict->shpool, len);
+    if (dict->sh->shards == NULL) {
+        return NGX_ERROR;
+    }
+
+    dict->sh->nshards = dict->nshards;
+    dict->sh->lockfree = dict->lockfree;
+
+    for (i = 0; i < dict->nshards; i++) {
+        shard = &dict->sh->shards[i];
+
+        ngx_queue_init(&shard->lru);
+    }
+
+    /* a full zone evicts keys, running out of memory is not an error */
+
+    dict->shpool->log_nomem = 0;
 
     len = sizeof(" in lua shared dict zone \"\"") + shm_zone->shm.name.len;
 
@@ -679,10 +2114,33 @@ static ngx_int_t
 ngx_http_lua_init(ngx_conf_t *cf)
 {
     ngx_http_handler_pt        *h;
+    ngx_http_lua_main_conf_t   *lmcf;
     ngx_http_core_main_conf_t  *cmcf;
 
+    lmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_lua_module);
+
+    if (ngx_lua_headers_init(cf, &lmcf->headers_out_hash) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
     cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
 
+    ngx_lua_request_var_index_register(lmcf->lua->state, &cmcf->variables);
+
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_REWRITE_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_lua_rewrite_handler;
+
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_ACCESS_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_lua_access_handler;
+
     h = ngx_array_push(&cmcf->phases[NGX_HTTP_PRECONTENT_PHASE].handlers);
     if (h == NULL) {
         return NGX_ERROR;
@@ -690,5 +2148,18 @@ ngx_http_lua_init(ngx_conf_t *cf)
 
     *h = ngx_http_lua_handler;
 
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_LOG_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_lua_log_handler;
+
+    ngx_http_next_header_filter = ngx_http_top_header_filter;
+    ngx_http_top_header_filter = ngx_http_lua_header_filter;
+
+    ngx_http_next_body_filter = ngx_http_top_body_filter;
+    ngx_http_top_body_filter = ngx_http_lua_body_filter;
+
     return NGX_OK;
 }
@@ -6,6 +6,8 @@
 #include <ngx_lua.h>
 #include <ngx_event.h>
 
+#define NGX_LUA_TABLE_MAX_KEYS  64
+
 static void ngx_lua_state_cleanup(void *data);
 
 ngx_lua_t *
@@ -48,10 +50,112 @@ ngx_lua_state_cleanup(void *data)
 }
 
 
+ngx_int_t
+ngx_lua_threads_init(ngx_lua_t *lua, ngx_pool_t *pool, ngx_uint_t size)
+{
+    ngx_lua_threads_t  *threads;
+
+    threads = ngx_pcalloc(pool, sizeof(ngx_lua_threads_t));
+    if (threads == NULL) {
+        return NGX_ERROR;
+    }
+
+    threads->free = ngx_palloc(pool, size * sizeof(ngx_lua_thread_t));
+    if (threads->free == NULL) {
+        return NGX_ERROR;
+    }
+
+    threads->size = size;
+
+    lua->threads = threads;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_lua_tables_init(ngx_lua_t *lua, ngx_pool_t *pool, ngx_uint_t size)
+{
+    ngx_lua_tables_t  *tables;
+
+    tables = ngx_pcalloc(pool, sizeof(ngx_lua_tables_t));
+    if (tables == NULL) {
+        return NGX_ERROR;
+    }
+
+    tables->free = ngx_palloc(pool, size * sizeof(int));
+    if (tables->free == NULL) {
+        return NGX_ERROR;
+    }
+
+    tables->size = size;
+
+    lua->tables = tables;
+
+    return NGX_OK;
+}
+
+
+int
+ngx_lua_table_get(lua_State *L, ngx_lua_tables_t *tables)
+{
+    if (tables != NULL && tables->nfree > 0) {
+        return tables->free[--tables->nfree];
+    }
+
+    lua_newtable(L);
+
+    return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+
+void
+ngx_lua_table_put(lua_State *L, ngx_lua_tables_t *tables, int ref)
+{
+    ngx_uint_t  n;
+
+    if (tables == NULL || tables->nfree == tables->size) {
+        luaL_unref(L, LUA_REGISTRYINDEX, ref);
+        return;
+    }
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+
+    lua_pushnil(L);
+    lua_setmetatable(L, -2);
+
+    /* clearing existing fields during traversal is allowed */
+
+    n = 0;
+    lua_pushnil(L);
+
+    while (lua_next(L, -2) != 0) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_pushnil(L);
+        lua_rawset(L, -4);
+        n++;
+    }
+
+    lua_pop(L, 1);
+
+    /* a table grown large keeps its size, let it go instead */
+
+    if (n > NGX_LUA_TABLE_MAX_KEYS) {
+        luaL_unref(L, LUA_REGISTRYINDEX, ref);
+        return;
+    }
+
+    tables->free[tables->nfree++] = ref;
+}
+
+
 ngx_lua_t *
 ngx_lua_clone(ngx_lua_t *from, ngx_pool_t *pool)
 {
-    ngx_lua_t  *lua;
+    ngx_lua_t          *lua;
+    ngx_lua_thread_t   *thread;
+    ngx_lua_threads_t  *threads;
 
     lua = ngx_pcalloc(pool, sizeof(ngx_lua_t));
     if (lua == NULL) {
@@ -60,12 +164,31 @@ ngx_lua_clone(ngx_lua_t *from, ngx_pool_t *pool)
 
     lua->pool = pool;
 
-    lua->state = lua_newthread(from->state);
-    if (lua->state == NULL) {
-        return NULL;
+    threads = from->threads;
+
+    if (threads != NULL && threads->nfree > 0) {
+        thread = &threads->free[--threads->nfree];
+
+        lua->state = thread->state;
+        lua->ref = thread->ref;
+
+        threads->hits++;
+
+    } else {
+        lua->state = lua_newthread(from->state);
+        if (lua->state == NULL) {
+            return NULL;
+        }
+
+        lua->ref = luaL_ref(from->state, LUA_REGISTRYINDEX);
+
+        if (threads != NULL) {
+            threads->misses++;
+        }
     }
 
-    lua->ref = luaL_ref(from->state, LUA_REGISTRYINDEX);
+    lua->threads = threads;
+    lua->tables = from->tables;
 
     ngx_lua_ext_set(lua->state, lua);
 
@@ -76,6 +199,37 @@ ngx_lua_clone(ngx_lua_t *from, ngx_pool_t *pool)
 void
 ngx_lua_free(lua_State *L, ngx_lua_t *lua)
 {
+    ngx_lua_thread_t   *thread;
+    ngx_lua_threads_t  *threads;
+
+    threads = lua->threads;
+
+    if (lua->sleep != NULL && lua->sleep->timer_set) {
+        ngx_del_timer(lua->sleep);
+    }
+
+    if (lua->wake != NULL && lua->wake->posted) {
+        ngx_delete_posted_event(lua->wake);
+    }
+
+    /*
+     * A finished or abandoned coroutine is reset with lua_closethread(),
+     * which unwinds its call stack, runs pending to-be-closed variables
+     * and shrinks the stack, and is then kept for the next ngx_lua_clone().
+     */
+
+    if (threads != NULL
+        && threads->nfree < threads->size
+        && lua_closethread(lua->state, L) == LUA_OK)
+    {
+        thread = &threads->free[threads->nfree++];
+
+        thread->state = lua->state;
+        thread->ref = lua->ref;
+
+        return;
+    }
+
     luaL_unref(L, LUA_REGISTRYINDEX, lua->ref);
 }
 
@@ -123,3 +277,43 @@ ngx_lua_wake(ngx_lua_t *lua, int nresults)
 
     ngx_post_event(lua->wake, &ngx_posted_events);
 }
+
+
+static void
+ngx_lua_sleep_handler(ngx_event_t *ev)
+{
+    ngx_lua_t  *lua;
+
+    lua = ev->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_CORE, lua->log, 0, "lua sleep handler");
+
+    ngx_lua_wake(lua, 0);
+}
+
+
+ngx_int_t
+ngx_lua_sleep(ngx_lua_t *lua, ngx_msec_t msec)
+{
+    ngx_event_t  *ev;
+
+    ev = lua->sleep;
+
+    if (ev == NULL) {
+        ev = ngx_pcalloc(lua->pool, sizeof(ngx_event_t));
+        if (ev == NULL) {
+            return NGX_ERROR;
+        }
+
+        ev->handler = ngx_lua_sleep_handler;
+        ev->data = lua;
+
+        lua->sleep = ev;
+    }
+
+    ev->log = lua->log;
+
+    ngx_add_timer(ev, msec);
+
+    return NGX_OK;
+}
@@ -15,19 +15,48 @@
 typedef struct {
     lua_State       *state;
     int             ref;
-    void            *data;
-    ngx_pool_t      *pool;
-    ngx_log_t       *log;
-    ngx_event_t     *wake;
-    int             nresults;
+} ngx_lua_thread_t;
+
+typedef struct {
+    ngx_lua_thread_t  *free;
+    ngx_uint_t        nfree;
+    ngx_uint_t        size;
+    ngx_uint_t        hits;
+    ngx_uint_t        misses;
+} ngx_lua_threads_t;
+
+typedef struct {
+    int               *free;    /* registry refs of empty tables */
+    ngx_uint_t        nfree;
+    ngx_uint_t        size;
+} ngx_lua_tables_t;
+
+typedef struct {
+    lua_State          *state;
+    int                ref;
+    void               *data;
+    ngx_pool_t         *pool;
+    ngx_log_t          *log;
+    ngx_event_t        *wake;
+    int                nresults;
+    ngx_lua_threads_t  *threads;
+    ngx_lua_tables_t   *tables;
+    ngx_event_t        *sleep;
 } ngx_lua_t;
 
 ngx_lua_t *ngx_lua_create(ngx_pool_t *pool);
+ngx_int_t ngx_lua_threads_init(ngx_lua_t *lua, ngx_pool_t *pool,
+    ngx_uint_t size);
+ngx_int_t ngx_lua_tables_init(ngx_lua_t *lua, ngx_pool_t *pool,
+    ngx_uint_t size);
+int ngx_lua_table_get(lua_State *L, ngx_lua_tables_t *tables);
+void ngx_lua_table_put(lua_State *L, ngx_lua_tables_t *tables, int ref);
 ngx_lua_t *ngx_lua_clone(ngx_lua_t *from, ngx_pool_t *pool);
 void ngx_lua_free(lua_State *L, ngx_lua_t *lua);
 ngx_int_t ngx_lua_call(ngx_lua_t *lua, int nargs, ngx_event_t *wake);
 int ngx_lua_yield(ngx_lua_t *lua);
 void ngx_lua_wake(ngx_lua_t *lua, int nresults);
+ngx_int_t ngx_lua_sleep(ngx_lua_t *lua, ngx_msec_t msec);
 
 #define ngx_lua_ext_set(L, ext)                                     \
     *((void **) lua_getextraspace(L)) = ext;
@@ -0,0 +1,291 @@
+
+/*
+ * Copyright (C) Zhidao HONG
+ */
+
+#include <ngx_lua_http.h>
+
+#define LUA_BODY_META  "body.meta"
+
+typedef struct {
+    u_char              *data;
+    size_t              len;
+    ngx_pool_cleanup_t  *cleanup;
+} ngx_lua_body_t;
+
+static int ngx_lua_body_len(lua_State *L);
+static int ngx_lua_body_sub(lua_State *L);
+static int ngx_lua_body_find(lua_State *L);
+static int ngx_lua_body_tostring(lua_State *L);
+static int ngx_lua_body_free(lua_State *L);
+static void ngx_lua_body_cleanup(void *data);
+
+static const struct luaL_Reg  ngx_lua_body_methods[] = {
+    {"sub", ngx_lua_body_sub},
+    {"find", ngx_lua_body_find},
+    {NULL, NULL},
+};
+
+
+void
+ngx_lua_body_metatable(lua_State *L)
+{
+    luaL_newmetatable(L, LUA_BODY_META);
+
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, ngx_lua_body_len);
+    lua_setfield(L, -2, "__len");
+
+    lua_pushcfunction(L, ngx_lua_body_tostring);
+    lua_setfield(L, -2, "__tostring");
+
+    lua_pushcfunction(L, ngx_lua_body_free);
+    lua_setfield(L, -2, "__gc");
+
+    luaL_setfuncs(L, ngx_lua_body_methods, 0);
+
+    lua_pop(L, 1);
+}
+
+
+int
+ngx_lua_body_view(lua_State *L, ngx_http_request_t *r)
+{
+    u_char              *p;
+    size_t              len;
+    ngx_file_t          *file;
+    ngx_lua_body_t      *body;
+    ngx_pool_cleanup_t  *cln;
+
+    file = &r->request_body->temp_file->file;
+    len = (size_t) file->offset;
+
+    body = lua_newuserdatauv(L, sizeof(ngx_lua_body_t), 0);
+
+    body->data = NULL;
+    body->len = 0;
+    body->cleanup = NULL;
+
+    luaL_setmetatable(L, LUA_BODY_META);
+
+    if (len == 0) {
+        return 1;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return luaL_error(L, "body failed");
+    }
+
+    p = mmap(NULL, len, PROT_READ, MAP_SHARED, file->fd, 0);
+
+    if (p == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_errno,
+                      "mmap(%uz) \"%V\" failed", len, &file->name);
+        return luaL_error(L, "body failed");
+    }
+
+    /* the mapping goes away with the request or the view */
+
+    cln->handler = ngx_lua_body_cleanup;
+    cln->data = body;
+
+    body->data = p;
+    body->len = len;
+    body->cleanup = cln;
+
+    return 1;
+}
+
+
+static ngx_lua_body_t *
+ngx_lua_body_check(lua_State *L)
+{
+    ngx_lua_body_t  *body;
+
+    body = luaL_checkudata(L, 1, LUA_BODY_META);
+
+    if (body->data == NULL && body->len != 0) {
+        luaL_error(L, "body is no longer available");
+    }
+
+    return body;
+}
+
+
+static size_t
+ngx_lua_body_position(lua_Integer pos, size_t len)
+{
+    if (pos > 0) {
+        return (size_t) pos;
+    }
+
+    if (pos == 0) {
+        return 1;
+    }
+
+    if (pos < -(lua_Integer) len) {
+        return 1;
+    }
+
+    return len + (size_t) pos + 1;
+}
+
+
+static size_t
+ngx_lua_body_end(lua_Integer pos, size_t len)
+{
+    if (pos > (lua_Integer) len) {
+        return len;
+    }
+
+    if (pos >= 0) {
+        return (size_t) pos;
+    }
+
+    if (pos < -(lua_Integer) len) {
+        return 0;
+    }
+
+    return len + (size_t) pos + 1;
+}
+
+
+static int
+ngx_lua_body_len(lua_State *L)
+{
+    ngx_lua_body_t  *body;
+
+    body = ngx_lua_body_check(L);
+
+    lua_pushinteger(L, body->len);
+
+    return 1;
+}
+
+
+static int
+ngx_lua_body_sub(lua_State *L)
+{
+    size_t          start, end;
+    ngx_lua_body_t  *body;
+
+    body = ngx_lua_body_check(L);
+
+    start = ngx_lua_body_position(luaL_checkinteger(L, 2), body->len);
+    end = ngx_lua_body_end(luaL_optinteger(L, 3, -1), body->len);
+
+    if (start > end) {
+        lua_pushliteral(L, "");
+        return 1;
+    }
+
+    lua_pushlstring(L, (char *) body->data + start - 1, end - start + 1);
+
+    return 1;
+}
+
+
+static int
+ngx_lua_body_find(lua_State *L)
+{
+    u_char          *p, *last;
+    size_t          init;
+    ngx_str_t       text;
+    ngx_lua_body_t  *body;
+
+    body = ngx_lua_body_check(L);
+
+    text.data = (u_char *) luaL_checklstring(L, 2, &text.len);
+    init = ngx_lua_body_position(luaL_optinteger(L, 3, 1), body->len);
+
+    if (init > body->len + 1 || text.len > body->len - (init - 1)) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    if (text.len == 0) {
+        lua_pushinteger(L, init);
+        lua_pushinteger(L, init - 1);
+        return 2;
+    }
+
+    /* a plain search, the body is not a pattern subject */
+
+    p = body->data + init - 1;
+    last = body->data + body->len - text.len + 1;
+
+    while (p < last) {
+        p = ngx_strlchr(p, last, text.data[0]);
+
+        if (p == NULL) {
+            break;
+        }
+
+        if (ngx_memcmp(p, text.data, text.len) == 0) {
+            lua_pushinteger(L, p - body->data + 1);
+            lua_pushinteger(L, p - body->data + text.len);
+            return 2;
+        }
+
+        p++;
+    }
+
+    lua_pushnil(L);
+
+    return 1;
+}
+
+
+static int
+ngx_lua_body_tostring(lua_State *L)
+{
+    ngx_lua_body_t  *body;
+
+    body = ngx_lua_body_check(L);
+
+    lua_pushlstring(L, (char *) body->data, body->len);
+
+    return 1;
+}
+
+
+static void
+ngx_lua_body_unmap(ngx_lua_body_t *body)
+{
+    if (body->cleanup != NULL) {
+        body->cleanup->handler = NULL;
+        body->cleanup = NULL;
+    }
+
+    if (body->data != NULL) {
+        (void) munmap(body->data, body->len);
+        body->data = NULL;
+    }
+}
+
+
+static int
+ngx_lua_body_free(lua_State *L)
+{
+    ngx_lua_body_t  *body;
+
+    body = lua_touserdata(L, 1);
+
+    ngx_lua_body_unmap(body);
+
+    return 0;
+}
+
+
+static void
+ngx_lua_body_cleanup(void *data)
+{
+    ngx_lua_body_t  *body = data;
+
+    body->cleanup = NULL;
+
+    ngx_lua_body_unmap(body);
+}
@@ -42,6 +42,9 @@ ngx_lua_conf_new(ngx_lua_t *lua, ngx_log_t *log)
         return NULL;
     }
 
+    conf->pool = NULL;
+    conf->lua = NULL;
+
     luaL_setmetatable(L, "lua_conf_metatable");
     conf->conf_ref = luaL_ref(L, LUA_REGISTRYINDEX);
 
@@ -53,6 +56,8 @@ ngx_lua_conf_new(ngx_lua_t *lua, ngx_log_t *log)
         return NULL;
     }
 
+    conf->pool = pool;
+
     conf->lua = ngx_lua_clone(lua, pool);
     if (conf->lua == NULL) {
         return NULL;
@@ -71,9 +76,15 @@ ngx_lua_conf_free(lua_State *L)
 
     conf = lua_touserdata(L, 1);
 
-    ngx_destroy_pool(conf->pool);
     luaL_unref(L, LUA_REGISTRYINDEX, conf->data_ref);
-    ngx_lua_free(L, conf->lua);
+
+    if (conf->lua != NULL) {
+        ngx_lua_free(L, conf->lua);
+    }
+
+    if (conf->pool != NULL) {
+        ngx_destroy_pool(conf->pool);
+    }
 
     return 0;
 }
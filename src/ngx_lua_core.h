@@ -11,10 +11,12 @@
 #include <ngx_lua_dict.h>
 
 void ngx_lua_nginx_register(lua_State *L);
+int ngx_lua_nginx_sleep(lua_State *L);
 void ngx_lua_conf_register(lua_State *L);
 void ngx_lua_json_register(lua_State *L);
 void ngx_lua_dict_register(lua_State *L);
 void ngx_lua_cidr_register(lua_State *L);
+void ngx_lua_socket_register(lua_State *L);
 int ngx_lua_cidr_match(ngx_cidr_t *cidr, struct sockaddr *sockaddr);
 
 #endif /* NGX_LUA_CORE_H */
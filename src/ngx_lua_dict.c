@@ -11,6 +11,24 @@
  * with some modifications.
  */
 
+#define NGX_LUA_DICT_SET        0
+#define NGX_LUA_DICT_ADD        1
+#define NGX_LUA_DICT_REPLACE    2
+
+#define NGX_LUA_DICT_EXPIRE_SCAN  8
+#define NGX_LUA_DICT_EVICT_MAX    30
+
+#define NGX_LUA_DICT_MIN_SLOTS    16
+#define NGX_LUA_DICT_MIGRATE      64
+
+#define NGX_LUA_DICT_READ_TRIES   64
+
+#define NGX_LUA_DICT_PRIME1       0x9e3779b185ebca87ULL
+#define NGX_LUA_DICT_PRIME2       0xc2b2ae3d27d4eb4fULL
+#define NGX_LUA_DICT_PRIME3       0x165667b19e3779f9ULL
+#define NGX_LUA_DICT_PRIME4       0x85ebca77c2b2ae63ULL
+#define NGX_LUA_DICT_PRIME5       0x27d4eb2f165667c5ULL
+
 typedef struct {
     ngx_lua_dict_t   *dict;
 } ngx_lua_dict_data_t;
@@ -18,10 +36,35 @@ typedef struct {
 static int ngx_lua_dict_index(lua_State *L);
 static int ngx_lua_dict_get(lua_State *L);
 static int ngx_lua_dict_set(lua_State *L);
+static int ngx_lua_dict_add(lua_State *L);
+static int ngx_lua_dict_replace(lua_State *L);
+static int ngx_lua_dict_delete(lua_State *L);
+static int ngx_lua_dict_incr(lua_State *L);
+static int ngx_lua_dict_ttl(lua_State *L);
+static int ngx_lua_dict_expire(lua_State *L);
+static int ngx_lua_dict_stats(lua_State *L);
+static ngx_uint_t ngx_lua_dict_match(ngx_lua_dict_slot_t *slot,
+    uint64_t hash, ngx_str_t *name, ngx_lua_dict_node_t *node);
+static ngx_uint_t ngx_lua_dict_evict(ngx_lua_dict_t *dict,
+    ngx_lua_dict_shard_t *shard, ngx_lua_dict_node_t *keep);
+static void *ngx_lua_dict_alloc(ngx_lua_dict_t *dict,
+    ngx_lua_dict_shard_t *shard, size_t size, ngx_lua_dict_node_t *keep);
+static void ngx_lua_dict_remove(ngx_lua_dict_t *dict,
+    ngx_lua_dict_shard_t *shard, ngx_lua_dict_node_t *node);
+static ngx_int_t ngx_lua_dict_peek_slots(lua_State *L, ngx_lua_dict_t *dict,
+    ngx_lua_dict_slot_t *slots, ngx_uint_t size, ngx_uint_t base,
+    ngx_uint_t n, ngx_str_t *name, uint64_t hash);
 
 static const struct luaL_Reg  ngx_lua_dict_methods[] = {
     {"get", ngx_lua_dict_get},
     {"set", ngx_lua_dict_set},
+    {"add", ngx_lua_dict_add},
+    {"replace", ngx_lua_dict_replace},
+    {"delete", ngx_lua_dict_delete},
+    {"incr", ngx_lua_dict_incr},
+    {"ttl", ngx_lua_dict_ttl},
+    {"expire", ngx_lua_dict_expire},
+    {"stats", ngx_lua_dict_stats},
     {NULL, NULL},
 };
 
@@ -122,140 +165,1339 @@ ngx_lua_dict_index(lua_State *L)
 }
 
 
-static ngx_lua_dict_node_t *
-ngx_lua_dict_lookup(ngx_lua_dict_t *dict, ngx_str_t *name)
+static int
+ngx_lua_dict_error(lua_State *L, const char *err)
+{
+    lua_pushnil(L);
+    lua_pushstring(L, err);
+
+    return 2;
+}
+
+
+static void
+ngx_lua_dict_check_value(lua_State *L, int index, ngx_lua_dict_value_t *value)
 {
-    uint32_t       hash;
-    ngx_rbtree_t  *rbtree;
+    switch (lua_type(L, index)) {
+
+    case LUA_TSTRING:
+        value->type = NGX_LUA_DICT_STRING;
+        value->str.data = (u_char *) lua_tolstring(L, index, &value->str.len);
+        break;
+
+    case LUA_TNUMBER:
+        if (lua_isinteger(L, index)) {
+            value->type = NGX_LUA_DICT_INTEGER;
+            value->u.integer = lua_tointeger(L, index);
+
+        } else {
+            value->type = NGX_LUA_DICT_NUMBER;
+            value->u.number = lua_tonumber(L, index);
+        }
 
-    rbtree = &dict->sh->rbtree;
+        break;
 
-    hash = ngx_crc32_long(name->data, name->len);
+    case LUA_TBOOLEAN:
+        value->type = NGX_LUA_DICT_BOOLEAN;
+        value->u.integer = lua_toboolean(L, index);
+        break;
 
-    return (ngx_lua_dict_node_t *) ngx_str_rbtree_lookup(rbtree, name, hash);
+    default:
+        luaL_typeerror(L, index, "string, number or boolean");
+    }
 }
 
 
-static int
-ngx_lua_dict_get(lua_State *L)
+static ngx_msec_t
+ngx_lua_dict_check_ttl(lua_State *L, int index)
 {
-    ngx_str_t              name;
-    ngx_lua_dict_t         *dict;
-    ngx_lua_dict_node_t    *node;
-    ngx_lua_dict_data_t    *data;
+    ngx_msec_t  ttl;
+    lua_Number  n;
 
-    data = luaL_checkudata(L, 1, LUA_DICT_META);
-    name.data = (u_char *) luaL_checklstring(L, 2, &name.len);
+    n = luaL_optnumber(L, index, 0);
 
-    dict = data->dict;
+    if (n < 0 || n > NGX_MAX_INT32_VALUE / 1000) {
+        luaL_error(L, "ttl is out of range");
+    }
+
+    if (n == 0) {
+        return 0;
+    }
 
-    ngx_rwlock_rlock(&dict->sh->rwlock);
+    /* a fractional ttl below a millisecond still expires */
 
-    node = ngx_lua_dict_lookup(dict, &name);
+    ttl = (ngx_msec_t) (n * 1000);
 
-    if (node == NULL) {
-        goto not_found;
+    return ngx_current_msec + (ttl ? ttl : 1);
+}
+
+
+static ngx_uint_t
+ngx_lua_dict_expired(ngx_lua_dict_node_t *node)
+{
+    return node->expires != 0
+           && (ngx_msec_int_t) (node->expires - ngx_current_msec) <= 0;
+}
+
+
+static void
+ngx_lua_dict_push_value(lua_State *L, ngx_lua_dict_value_t *value)
+{
+    switch (value->type) {
+
+    case NGX_LUA_DICT_STRING:
+        lua_pushlstring(L, (const char *) value->str.data, value->str.len);
+        break;
+
+    case NGX_LUA_DICT_NUMBER:
+        lua_pushnumber(L, value->u.number);
+        break;
+
+    case NGX_LUA_DICT_INTEGER:
+        lua_pushinteger(L, value->u.integer);
+        break;
+
+    default: /* NGX_LUA_DICT_BOOLEAN */
+        lua_pushboolean(L, (int) value->u.integer);
+        break;
     }
+}
 
-    lua_pushlstring(L, (const char *) node->value.data, node->value.len);
 
-    ngx_rwlock_unlock(&dict->sh->rwlock);
+/*
+ * The 64-bit xxHash of the key, read in native byte order: the hash
+ * is only kept in the zone of one host.
+ */
 
-    return 1;
+#define ngx_lua_dict_rotl(x, r)  (((x) << (r)) | ((x) >> (64 - (r))))
 
-not_found:
+static uint64_t
+ngx_lua_dict_round(uint64_t acc, uint64_t input)
+{
+    acc += input * NGX_LUA_DICT_PRIME2;
+    acc = ngx_lua_dict_rotl(acc, 31);
 
-    ngx_rwlock_unlock(&dict->sh->rwlock);
+    return acc * NGX_LUA_DICT_PRIME1;
+}
 
-    return 0;
+
+static uint64_t
+ngx_lua_dict_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= ngx_lua_dict_round(0, val);
+
+    return acc * NGX_LUA_DICT_PRIME1 + NGX_LUA_DICT_PRIME4;
 }
 
 
-static ngx_int_t
-ngx_lua_dict_add(ngx_lua_dict_t *dict, ngx_str_t *name, ngx_str_t *value)
+static uint64_t
+ngx_lua_dict_hash(u_char *p, size_t len)
 {
-    size_t               n;
-    ngx_lua_dict_node_t  *node;
+    u_char    *last;
+    uint32_t  k32;
+    uint64_t  h, k, v1, v2, v3, v4;
 
-    n = sizeof(ngx_lua_dict_node_t) + name->len;
+    last = p + len;
 
-    node = ngx_slab_alloc_locked(dict->shpool, n);
-    if (node == NULL) {
-        return NGX_ERROR;
+    if (len >= 32) {
+        v1 = NGX_LUA_DICT_PRIME1 + NGX_LUA_DICT_PRIME2;
+        v2 = NGX_LUA_DICT_PRIME2;
+        v3 = 0;
+        v4 = - NGX_LUA_DICT_PRIME1;
+
+        do {
+            ngx_memcpy(&k, p, 8);
+            v1 = ngx_lua_dict_round(v1, k);
+            ngx_memcpy(&k, p + 8, 8);
+            v2 = ngx_lua_dict_round(v2, k);
+            ngx_memcpy(&k, p + 16, 8);
+            v3 = ngx_lua_dict_round(v3, k);
+            ngx_memcpy(&k, p + 24, 8);
+            v4 = ngx_lua_dict_round(v4, k);
+
+            p += 32;
+
+        } while (last - p >= 32);
+
+        h = ngx_lua_dict_rotl(v1, 1) + ngx_lua_dict_rotl(v2, 7)
+            + ngx_lua_dict_rotl(v3, 12) + ngx_lua_dict_rotl(v4, 18);
+
+        h = ngx_lua_dict_merge(h, v1);
+        h = ngx_lua_dict_merge(h, v2);
+        h = ngx_lua_dict_merge(h, v3);
+        h = ngx_lua_dict_merge(h, v4);
+
+    } else {
+        h = NGX_LUA_DICT_PRIME5;
     }
 
-    node->sn.str.data = (u_char *) node + sizeof(ngx_lua_dict_node_t);
+    h += len;
 
-    node->value.data = ngx_slab_alloc_locked(dict->shpool, value->len);
-    if (node->value.data == NULL) {
-        ngx_slab_free_locked(dict->shpool, node);
-        return NGX_ERROR;
+    while (last - p >= 8) {
+        ngx_memcpy(&k, p, 8);
+        h ^= ngx_lua_dict_round(0, k);
+        h = ngx_lua_dict_rotl(h, 27) * NGX_LUA_DICT_PRIME1
+            + NGX_LUA_DICT_PRIME4;
+        p += 8;
+    }
+
+    if (last - p >= 4) {
+        ngx_memcpy(&k32, p, 4);
+        h ^= (uint64_t) k32 * NGX_LUA_DICT_PRIME1;
+        h = ngx_lua_dict_rotl(h, 23) * NGX_LUA_DICT_PRIME2
+            + NGX_LUA_DICT_PRIME3;
+        p += 4;
     }
 
-    ngx_memcpy(node->value.data, value->data, value->len);
-    node->value.len = value->len;
+    while (p < last) {
+        h ^= *p++ * NGX_LUA_DICT_PRIME5;
+        h = ngx_lua_dict_rotl(h, 11) * NGX_LUA_DICT_PRIME1;
+    }
 
-    ngx_memcpy(node->sn.str.data, name->data, name->len);
-    node->sn.str.len = name->len;
-    node->sn.node.key = ngx_crc32_long(name->data, name->len);
+    h ^= h >> 33;
+    h *= NGX_LUA_DICT_PRIME2;
+    h ^= h >> 29;
+    h *= NGX_LUA_DICT_PRIME3;
+    h ^= h >> 32;
 
-    ngx_rbtree_insert(&dict->sh->rbtree, &node->sn.node);
+    return h;
+}
 
-    return NGX_OK;
+
+static ngx_lua_dict_shard_t *
+ngx_lua_dict_shard(ngx_lua_dict_t *dict, ngx_str_t *name, uint64_t *hash)
+{
+    *hash = ngx_lua_dict_hash(name->data, name->len);
+
+    /* the low bits pick the slot, the high ones the shard */
+
+    return &dict->sh->shards[(*hash >> 32) % dict->sh->nshards];
+}
+
+
+/*
+ * Each shard indexes its nodes in an open addressing table with linear
+ * probing.  When the table fills up, a table twice as large replaces it
+ * and writers move a few slots of the old one at a time.  Nothing is
+ * added to the old table meanwhile, so its probe sequences never cross
+ * the free slot the move started at: the old table is walked in order
+ * from there, and the slots already moved are skipped.
+ */
+
+static ngx_lua_dict_slot_t *
+ngx_lua_dict_find(ngx_lua_dict_shard_t *shard, uint64_t hash,
+    ngx_str_t *name, ngx_lua_dict_node_t *node)
+{
+    ngx_uint_t           i, mask;
+    ngx_lua_dict_slot_t  *slot;
+
+    if (shard->size) {
+        mask = shard->size - 1;
+
+        for (i = hash & mask; /* void */; i = (i + 1) & mask) {
+            slot = &shard->slots[i];
+
+            if (slot->node == NULL) {
+                break;
+            }
+
+            if (ngx_lua_dict_match(slot, hash, name, node)) {
+                return slot;
+            }
+        }
+    }
+
+    if (shard->old == NULL) {
+        return NULL;
+    }
+
+    mask = shard->old_size - 1;
+
+    i = ((hash & mask) - shard->start) & mask;
+
+    for (i = ngx_max(i, shard->moved); i < shard->old_size; i++) {
+        slot = &shard->old[(shard->start + i) & mask];
+
+        if (slot->node == NULL) {
+            break;
+        }
+
+        if (ngx_lua_dict_match(slot, hash, name, node)) {
+            return slot;
+        }
+    }
+
+    return NULL;
+}
+
+
+static ngx_uint_t
+ngx_lua_dict_match(ngx_lua_dict_slot_t *slot, uint64_t hash, ngx_str_t *name,
+    ngx_lua_dict_node_t *node)
+{
+    if (node != NULL) {
+        return slot->node == node;
+    }
+
+    return slot->hash == hash
+           && slot->node->key.len == name->len
+           && ngx_memcmp(slot->node->key.data, name->data, name->len) == 0;
+}
+
+
+static ngx_lua_dict_node_t *
+ngx_lua_dict_lookup(ngx_lua_dict_shard_t *shard, ngx_str_t *name,
+    uint64_t hash)
+{
+    ngx_lua_dict_slot_t  *slot;
+
+    slot = ngx_lua_dict_find(shard, hash, name, NULL);
+
+    return slot ? slot->node : NULL;
+}
+
+
+static void
+ngx_lua_dict_put(ngx_lua_dict_shard_t *shard, uint64_t hash,
+    ngx_lua_dict_node_t *node)
+{
+    ngx_uint_t           i, mask;
+    ngx_lua_dict_slot_t  *slot;
+
+    mask = shard->size - 1;
+
+    for (i = hash & mask; /* void */; i = (i + 1) & mask) {
+        slot = &shard->slots[i];
+
+        if (slot->node == NULL) {
+            break;
+        }
+    }
+
+    slot->hash = hash;
+    slot->node = node;
+
+    shard->used++;
+}
+
+
+/* the following slots move back into the freed one where they can */
+
+static void
+ngx_lua_dict_clear(ngx_lua_dict_shard_t *shard, ngx_lua_dict_slot_t *slot)
+{
+    ngx_uint_t           i, j, k, mask;
+    ngx_lua_dict_slot_t  *next;
+
+    if (shard->old != NULL
+        && slot >= shard->old && slot < shard->old + shard->old_size)
+    {
+        mask = shard->old_size - 1;
+
+        i = ((slot - shard->old) - shard->start) & mask;
+
+        for (j = i + 1; j < shard->old_size; j++) {
+            next = &shard->old[(shard->start + j) & mask];
+
+            if (next->node == NULL) {
+                break;
+            }
+
+            k = ((next->hash & mask) - shard->start) & mask;
+
+            if (ngx_max(k, shard->moved) <= i) {
+                *slot = *next;
+                slot = next;
+                i = j;
+            }
+        }
+
+        slot->node = NULL;
+
+        return;
+    }
+
+    mask = shard->size - 1;
+
+    i = slot - shard->slots;
+
+    for (j = (i + 1) & mask; shard->slots[j].node; j = (j + 1) & mask) {
+        next = &shard->slots[j];
+
+        k = next->hash & mask;
+
+        /* the home slot k of the next node is not within (i, j] */
+
+        if (((j - k) & mask) >= ((j - i) & mask)) {
+            *slot = *next;
+            slot = next;
+            i = j;
+        }
+    }
+
+    slot->node = NULL;
+
+    shard->used--;
+}
+
+
+static void
+ngx_lua_dict_migrate(ngx_lua_dict_t *dict, ngx_lua_dict_shard_t *shard,
+    ngx_uint_t n)
+{
+    ngx_uint_t           mask;
+    ngx_lua_dict_slot_t  *slot;
+
+    mask = shard->old_size - 1;
+
+    while (n-- && shard->moved < shard->old_size) {
+        slot = &shard->old[(shard->start + shard->moved) & mask];
+
+        if (slot->node != NULL) {
+            ngx_lua_dict_put(shard, slot->hash, slot->node);
+            slot->node = NULL;
+        }
+
+        shard->moved++;
+    }
+
+    if (shard->moved == shard->old_size) {
+        ngx_slab_free(dict->shpool, shard->old);
+        shard->old = NULL;
+        shard->old_size = 0;
+    }
 }
 
 
+/* makes sure the table has room for one more node */
+
 static ngx_int_t
-ngx_lua_dict_update(ngx_lua_dict_t *dict, ngx_lua_dict_node_t *node,
-    ngx_str_t *value)
+ngx_lua_dict_reserve(ngx_lua_dict_t *dict, ngx_lua_dict_shard_t *shard)
 {
-    u_char  *p;
+    ngx_uint_t           i, size;
+    ngx_lua_dict_slot_t  *slots;
+
+    if (shard->old != NULL) {
+        ngx_lua_dict_migrate(dict, shard, NGX_LUA_DICT_MIGRATE);
+    }
+
+    if (shard->used + 1 <= shard->size / 4 * 3) {
+        return NGX_OK;
+    }
+
+    if (shard->old != NULL) {
+        ngx_lua_dict_migrate(dict, shard, shard->old_size);
+    }
+
+    size = shard->size ? shard->size * 2 : NGX_LUA_DICT_MIN_SLOTS;
+
+    slots = ngx_lua_dict_alloc(dict, shard, size * sizeof(ngx_lua_dict_slot_t),
+                               NULL);
+
+    if (slots == NULL) {
+
+        /* a fuller table still works while a slot is left free */
+
+        if (shard->used + 1 < shard->size) {
+            return NGX_OK;
+        }
+
+        if (shard->size && ngx_lua_dict_evict(dict, shard, NULL)) {
+            return NGX_OK;
+        }
 
-    p = ngx_slab_alloc_locked(dict->shpool, value->len);
-    if (p == NULL) {
         return NGX_ERROR;
     }
 
-    ngx_slab_free_locked(dict->shpool, node->value.data);
+    ngx_memzero(slots, size * sizeof(ngx_lua_dict_slot_t));
+
+    if (shard->size) {
+        for (i = 0; shard->slots[i].node; i++) { /* void */ }
+
+        shard->old = shard->slots;
+        shard->old_size = shard->size;
+        shard->start = i;
+        shard->moved = 0;
+    }
 
-    node->value.data = p;
-    ngx_memcpy(node->value.data, value->data, value->len);
+    shard->slots = slots;
+    shard->size = size;
+    shard->used = 0;
 
-    node->value.len = value->len;
+    if (shard->old != NULL) {
+        ngx_lua_dict_migrate(dict, shard, NGX_LUA_DICT_MIGRATE);
+    }
 
     return NGX_OK;
 }
 
 
-static int
-ngx_lua_dict_set(lua_State *L)
+/*
+ * Frees one node of the shard: an expired one near the tail of the LRU
+ * queue if there is one, otherwise the least recently used node, unless
+ * it was read since it was queued, which gives it a second chance.
+ */
+
+static ngx_uint_t
+ngx_lua_dict_evict(ngx_lua_dict_t *dict, ngx_lua_dict_shard_t *shard,
+    ngx_lua_dict_node_t *keep)
 {
-    ngx_int_t            ret;
-    ngx_str_t            name, value;
-    ngx_lua_dict_t       *dict;
+    ngx_uint_t           n;
+    ngx_queue_t          *q;
     ngx_lua_dict_node_t  *node;
-    ngx_lua_dict_data_t  *data;
 
-    data = luaL_checkudata(L, 1, LUA_DICT_META);
-    dict = data->dict;
+    q = ngx_queue_last(&shard->lru);
 
-    name.data = (u_char *) luaL_checklstring(L, 2, &name.len);
-    value.data = (u_char *) luaL_checklstring(L, 3, &value.len);
+    for (n = 0; n < NGX_LUA_DICT_EXPIRE_SCAN; n++) {
 
-    ngx_rwlock_wlock(&dict->sh->rwlock);
+        if (q == ngx_queue_sentinel(&shard->lru)) {
+            break;
+        }
 
-    node = ngx_lua_dict_lookup(dict, &name);
+        node = ngx_queue_data(q, ngx_lua_dict_node_t, queue);
+        q = ngx_queue_prev(q);
 
-    if (node == NULL) {
-        ret = ngx_lua_dict_add(dict, &name, &value);
+        if (node != keep && ngx_lua_dict_expired(node)) {
+            goto evict;
+        }
+    }
 
-    } else {
-        ret = ngx_lua_dict_update(dict, node, &value);
+    for ( ;; ) {
+
+        if (ngx_queue_empty(&shard->lru)) {
+            return 0;
+        }
+
+        q = ngx_queue_last(&shard->lru);
+        node = ngx_queue_data(q, ngx_lua_dict_node_t, queue);
+
+        if (node == keep) {
+            if (q == ngx_queue_head(&shard->lru)) {
+                return 0;
+            }
+
+        } else if (!node->accessed) {
+            goto evict;
+        }
+
+        node->accessed = 0;
+
+        ngx_queue_remove(q);
+        ngx_queue_insert_head(&shard->lru, q);
+    }
+
+evict:
+
+    ngx_lua_dict_remove(dict, shard, node);
+
+    shard->evictions++;
+
+    return 1;
+}
+
+
+static void *
+ngx_lua_dict_alloc(ngx_lua_dict_t *dict, ngx_lua_dict_shard_t *shard,
+    size_t size, ngx_lua_dict_node_t *keep)
+{
+    void        *p;
+    ngx_uint_t  n;
+
+    /* shards share the slab pool, allocations take its own mutex */
+
+    p = ngx_slab_alloc(dict->shpool, size);
+
+    /* only nodes of the locked shard can be evicted */
+
+    for (n = 0; p == NULL && n < NGX_LUA_DICT_EVICT_MAX; n++) {
+
+        if (ngx_lua_dict_evict(dict, shard, keep) == 0) {
+            return NULL;
+        }
+
+        p = ngx_slab_alloc(dict->shpool, size);
+    }
+
+    return p;
+}
+
+
+/*
+ * A node is allocated with its key and value right after it.  The size
+ * is rounded up to the slab chunk or page that holds it anyway, so a
+ * value can grow into the slack without a new allocation.
+ */
+
+static size_t
+ngx_lua_dict_node_size(ngx_lua_dict_t *dict, size_t size)
+{
+    size_t  n;
+
+    if (size > ngx_pagesize / 2) {
+        return ngx_align(size, ngx_pagesize);
+    }
+
+    for (n = dict->shpool->min_size; n < size; n <<= 1) { /* void */ }
+
+    return n;
+}
+
+
+static size_t
+ngx_lua_dict_node_len(ngx_str_t *key, ngx_lua_dict_value_t *value)
+{
+    size_t  len;
+
+    len = sizeof(ngx_lua_dict_node_t) + key->len;
+
+    if (value->type == NGX_LUA_DICT_STRING) {
+        len += value->str.len;
+    }
+
+    return len;
+}
+
+
+static void
+ngx_lua_dict_set_value(ngx_lua_dict_node_t *node, ngx_lua_dict_value_t *value)
+{
+    node->value = *value;
+
+    if (value->type != NGX_LUA_DICT_STRING) {
+        ngx_str_null(&node->value.str);
+        return;
+    }
+
+    node->value.str.data = node->key.data + node->key.len;
+    ngx_memcpy(node->value.str.data, value->str.data, value->str.len);
+}
+
+
+static ngx_lua_dict_node_t *
+ngx_lua_dict_new_node(ngx_lua_dict_t *dict, ngx_lua_dict_shard_t *shard,
+    ngx_str_t *key, ngx_lua_dict_value_t *value, ngx_lua_dict_node_t *keep)
+{
+    size_t               size;
+    ngx_lua_dict_node_t  *node;
+
+    size = ngx_lua_dict_node_size(dict, ngx_lua_dict_node_len(key, value));
+
+    node = ngx_lua_dict_alloc(dict, shard, size, keep);
+    if (node == NULL) {
+        return NULL;
     }
 
-    lua_pushboolean(L, (ret != NGX_OK));
+    node->size = size;
+    node->accessed = 0;
+
+    node->key.data = (u_char *) node + sizeof(ngx_lua_dict_node_t);
+    node->key.len = key->len;
+    ngx_memcpy(node->key.data, key->data, key->len);
+
+    ngx_lua_dict_set_value(node, value);
+
+    return node;
+}
+
+
+static void
+ngx_lua_dict_touch(ngx_lua_dict_shard_t *shard, ngx_lua_dict_node_t *node)
+{
+    node->accessed = 0;
+
+    ngx_queue_remove(&node->queue);
+    ngx_queue_insert_head(&shard->lru, &node->queue);
+}
+
+
+static ngx_int_t
+ngx_lua_dict_insert(ngx_lua_dict_t *dict, ngx_lua_dict_shard_t *shard,
+    ngx_str_t *name, uint64_t hash, ngx_lua_dict_value_t *value,
+    ngx_msec_t expires)
+{
+    ngx_lua_dict_node_t  *node;
+
+    if (ngx_lua_dict_reserve(dict, shard) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    node = ngx_lua_dict_new_node(dict, shard, name, value, NULL);
+    if (node == NULL) {
+        return NGX_ERROR;
+    }
+
+    node->hash = hash;
+    node->expires = expires;
+
+    ngx_lua_dict_put(shard, hash, node);
+    ngx_queue_insert_head(&shard->lru, &node->queue);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_lua_dict_update(ngx_lua_dict_t *dict, ngx_lua_dict_shard_t *shard,
+    ngx_lua_dict_node_t *node, ngx_lua_dict_value_t *value,
+    ngx_msec_t expires)
+{
+    size_t               len;
+    ngx_lua_dict_node_t  *copy;
+
+    ngx_lua_dict_touch(shard, node);
+
+    len = ngx_lua_dict_node_len(&node->key, value);
+
+    /* the value is rewritten in place unless most of the node is left unused */
+
+    if (len <= node->size && len > node->size / 4) {
+        ngx_lua_dict_set_value(node, value);
+        node->expires = expires;
+
+        return NGX_OK;
+    }
+
+    copy = ngx_lua_dict_new_node(dict, shard, &node->key, value, node);
+    if (copy == NULL) {
+        return NGX_ERROR;
+    }
+
+    copy->hash = node->hash;
+    copy->expires = expires;
+
+    ngx_lua_dict_find(shard, node->hash, NULL, node)->node = copy;
+
+    ngx_queue_insert_after(&node->queue, &copy->queue);
+    ngx_queue_remove(&node->queue);
+
+    ngx_slab_free(dict->shpool, node);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_lua_dict_remove(ngx_lua_dict_t *dict, ngx_lua_dict_shard_t *shard,
+    ngx_lua_dict_node_t *node)
+{
+    ngx_lua_dict_clear(shard, ngx_lua_dict_find(shard, node->hash, NULL,
+                                                node));
+    ngx_queue_remove(&node->queue);
+
+    ngx_slab_free(dict->shpool, node);
+}
+
+
+/*
+ * In a lockfree zone writers still exclude each other with the lock, and
+ * also keep the sequence of the shard odd while they change it, so that
+ * readers can go without the lock and retry if it moved under them.
+ */
+
+static void
+ngx_lua_dict_wlock(ngx_lua_dict_t *dict, ngx_lua_dict_shard_t *shard)
+{
+    ngx_rwlock_wlock(&shard->rwlock);
+
+    if (dict->sh->lockfree) {
+        shard->seq++;
+        ngx_memory_barrier();
+    }
+}
+
+
+static void
+ngx_lua_dict_wunlock(ngx_lua_dict_t *dict, ngx_lua_dict_shard_t *shard)
+{
+    if (dict->sh->lockfree) {
+        ngx_memory_barrier();
+        shard->seq++;
+    }
+
+    ngx_rwlock_unlock(&shard->rwlock);
+}
+
+
+static ngx_uint_t
+ngx_lua_dict_in_zone(ngx_lua_dict_t *dict, void *p, size_t size)
+{
+    return (u_char *) p >= dict->shpool->start
+           && size <= (size_t) (dict->shpool->end - (u_char *) p);
+}
+
+
+/*
+ * Looks the key up without the lock.  Whatever is read may be changed
+ * or freed meanwhile, so no pointer is followed before it is checked to
+ * stay in the zone, the value is found by the key length and not by
+ * its pointer, and nothing is written.  The caller checks the sequence
+ * afterwards.
+ */
+
+static ngx_int_t
+ngx_lua_dict_peek(lua_State *L, ngx_lua_dict_t *dict,
+    ngx_lua_dict_shard_t *shard, ngx_str_t *name, uint64_t hash)
+{
+    ngx_int_t            rc;
+    ngx_uint_t           i, size, start, moved;
+    ngx_lua_dict_slot_t  *slots;
+
+    slots = shard->slots;
+    size = shard->size;
+
+    if (size == 0) {
+        return NGX_DECLINED;
+    }
+
+    rc = ngx_lua_dict_peek_slots(L, dict, slots, size, hash, size, name, hash);
+
+    if (rc != NGX_DECLINED) {
+        return rc;
+    }
+
+    slots = shard->old;
+    size = shard->old_size;
+    start = shard->start;
+    moved = shard->moved;
+
+    if (slots == NULL) {
+        return NGX_DECLINED;
+    }
+
+    if (start >= size || moved >= size) {
+        return NGX_AGAIN;
+    }
+
+    /* the old table is walked in order from where the move started */
+
+    i = ((hash & (size - 1)) - start) & (size - 1);
+    i = ngx_max(i, moved);
+
+    return ngx_lua_dict_peek_slots(L, dict, slots, size, start + i, size - i,
+                                   name, hash);
+}
+
+
+static ngx_int_t
+ngx_lua_dict_peek_slots(lua_State *L, ngx_lua_dict_t *dict,
+    ngx_lua_dict_slot_t *slots, ngx_uint_t size, ngx_uint_t base,
+    ngx_uint_t n, ngx_str_t *name, uint64_t hash)
+{
+    u_char                *p;
+    size_t                len, room;
+    ngx_uint_t            i, mask;
+    ngx_lua_dict_node_t   *node;
+    ngx_lua_dict_value_t  value;
+
+    if ((size & (size - 1))
+        || !ngx_lua_dict_in_zone(dict, slots,
+                                 size * sizeof(ngx_lua_dict_slot_t)))
+    {
+        return NGX_AGAIN;
+    }
+
+    mask = size - 1;
+
+    for (i = 0; i < n; i++) {
+        node = slots[(base + i) & mask].node;
+
+        if (node == NULL) {
+            return NGX_DECLINED;
+        }
+
+        if (slots[(base + i) & mask].hash != hash) {
+            continue;
+        }
+
+        if (!ngx_lua_dict_in_zone(dict, node, sizeof(ngx_lua_dict_node_t))) {
+            return NGX_AGAIN;
+        }
+
+        len = node->key.len;
+
+        if (len != name->len) {
+            continue;
+        }
+
+        room = node->size;
+
+        if (room < sizeof(ngx_lua_dict_node_t) + len
+            || !ngx_lua_dict_in_zone(dict, node, room))
+        {
+            return NGX_AGAIN;
+        }
+
+        room -= sizeof(ngx_lua_dict_node_t) + len;
+        p = (u_char *) node + sizeof(ngx_lua_dict_node_t);
+
+        if (ngx_memcmp(p, name->data, len) != 0) {
+            continue;
+        }
+
+        if (ngx_lua_dict_expired(node)) {
+            return NGX_DECLINED;
+        }
+
+        value = node->value;
+
+        if (value.type == NGX_LUA_DICT_STRING) {
+            if (value.str.len > room) {
+                return NGX_AGAIN;
+            }
+
+            value.str.data = p + len;
+        }
+
+        ngx_lua_dict_push_value(L, &value);
+
+        return NGX_OK;
+    }
+
+    return NGX_DECLINED;
+}
+
+
+static ngx_int_t
+ngx_lua_dict_read(lua_State *L, ngx_lua_dict_t *dict,
+    ngx_lua_dict_shard_t *shard, ngx_str_t *name, uint64_t hash)
+{
+    ngx_int_t          rc;
+    ngx_uint_t         tries;
+    ngx_atomic_uint_t  seq;
+
+    for (tries = 0; tries < NGX_LUA_DICT_READ_TRIES; tries++) {
+
+        seq = shard->seq;
+
+        if (seq & 1) {
+            ngx_cpu_pause();
+            continue;
+        }
+
+        ngx_memory_barrier();
+
+        rc = ngx_lua_dict_peek(L, dict, shard, name, hash);
+
+        ngx_memory_barrier();
+
+        /* the node may be freed by now, so it is not marked accessed */
+
+        if (shard->seq == seq && rc != NGX_AGAIN) {
+            return rc;
+        }
+
+        if (rc == NGX_OK) {
+            lua_pop(L, 1);
+        }
+    }
+
+    return NGX_BUSY;
+}
+
+
+static int
+ngx_lua_dict_get(lua_State *L)
+{
+    uint64_t              hash;
+    ngx_str_t             name;
+    ngx_lua_dict_t        *dict;
+    ngx_lua_dict_node_t   *node;
+    ngx_lua_dict_data_t   *data;
+    ngx_lua_dict_shard_t  *shard;
+
+    data = luaL_checkudata(L, 1, LUA_DICT_META);
+    name.data = (u_char *) luaL_checklstring(L, 2, &name.len);
+
+    dict = data->dict;
+
+    shard = ngx_lua_dict_shard(dict, &name, &hash);
+
+    if (dict->sh->lockfree) {
+
+        switch (ngx_lua_dict_read(L, dict, shard, &name, hash)) {
+
+        case NGX_OK:
+            return 1;
+
+        case NGX_DECLINED:
+            return 0;
+
+        default: /* NGX_BUSY */
+
+            /* writers kept changing the shard, the lock waits for them */
+            break;
+        }
+    }
+
+    ngx_rwlock_rlock(&shard->rwlock);
+
+    node = ngx_lua_dict_lookup(shard, &name, hash);
+
+    /* an expired node is left for the next writer to reclaim */
+
+    if (node == NULL || ngx_lua_dict_expired(node)) {
+        goto not_found;
+    }
+
+    /* readers only mark the node, the queue is kept by writers */
+
+    if (!node->accessed) {
+        node->accessed = 1;
+    }
+
+    ngx_lua_dict_push_value(L, &node->value);
+
+    ngx_rwlock_unlock(&shard->rwlock);
+
+    return 1;
+
+not_found:
+
+    ngx_rwlock_unlock(&shard->rwlock);
+
+    return 0;
+}
+
+
+static int
+ngx_lua_dict_store(lua_State *L, ngx_uint_t op)
+{
+    uint64_t              hash;
+    ngx_int_t             ret;
+    ngx_str_t             name;
+    ngx_msec_t            expires;
+    ngx_lua_dict_t        *dict;
+    ngx_lua_dict_node_t   *node;
+    ngx_lua_dict_data_t   *data;
+    ngx_lua_dict_value_t  value;
+    ngx_lua_dict_shard_t  *shard;
+
+    data = luaL_checkudata(L, 1, LUA_DICT_META);
+    dict = data->dict;
+
+    name.data = (u_char *) luaL_checklstring(L, 2, &name.len);
+
+    if (op == NGX_LUA_DICT_SET && lua_isnil(L, 3)) {
+        return ngx_lua_dict_delete(L);
+    }
+
+    ngx_lua_dict_check_value(L, 3, &value);
+    expires = ngx_lua_dict_check_ttl(L, 4);
+
+    shard = ngx_lua_dict_shard(dict, &name, &hash);
+
+    ngx_lua_dict_wlock(dict, shard);
+
+    node = ngx_lua_dict_lookup(shard, &name, hash);
+
+    if (node != NULL && ngx_lua_dict_expired(node)) {
+        ngx_lua_dict_remove(dict, shard, node);
+        node = NULL;
+    }
+
+    if (node == NULL) {
+        if (op == NGX_LUA_DICT_REPLACE) {
+            ngx_lua_dict_wunlock(dict, shard);
+            return ngx_lua_dict_error(L, "not found");
+        }
+
+        ret = ngx_lua_dict_insert(dict, shard, &name, hash, &value,
+                                  expires);
+
+    } else {
+        if (op == NGX_LUA_DICT_ADD) {
+            ngx_lua_dict_wunlock(dict, shard);
+            return ngx_lua_dict_error(L, "exists");
+        }
+
+        ret = ngx_lua_dict_update(dict, shard, node, &value, expires);
+    }
+
+    ngx_lua_dict_wunlock(dict, shard);
+
+    if (ret != NGX_OK) {
+        return ngx_lua_dict_error(L, "no memory");
+    }
+
+    lua_pushboolean(L, 1);
+
+    return 1;
+}
+
+
+static int
+ngx_lua_dict_set(lua_State *L)
+{
+    return ngx_lua_dict_store(L, NGX_LUA_DICT_SET);
+}
+
+
+static int
+ngx_lua_dict_add(lua_State *L)
+{
+    return ngx_lua_dict_store(L, NGX_LUA_DICT_ADD);
+}
+
+
+static int
+ngx_lua_dict_replace(lua_State *L)
+{
+    return ngx_lua_dict_store(L, NGX_LUA_DICT_REPLACE);
+}
+
+
+static int
+ngx_lua_dict_delete(lua_State *L)
+{
+    uint64_t              hash;
+    ngx_str_t             name;
+    ngx_lua_dict_t        *dict;
+    ngx_lua_dict_node_t   *node;
+    ngx_lua_dict_data_t   *data;
+    ngx_lua_dict_shard_t  *shard;
+
+    data = luaL_checkudata(L, 1, LUA_DICT_META);
+    dict = data->dict;
+
+    name.data = (u_char *) luaL_checklstring(L, 2, &name.len);
+
+    shard = ngx_lua_dict_shard(dict, &name, &hash);
+
+    ngx_lua_dict_wlock(dict, shard);
+
+    node = ngx_lua_dict_lookup(shard, &name, hash);
+
+    if (node != NULL) {
+        ngx_lua_dict_remove(dict, shard, node);
+    }
+
+    ngx_lua_dict_wunlock(dict, shard);
+
+    lua_pushboolean(L, 1);
+
+    return 1;
+}
+
+
+static int
+ngx_lua_dict_incr(lua_State *L)
+{
+    uint64_t              hash;
+    ngx_str_t             name;
+    ngx_int_t             ret;
+    ngx_msec_t            expires;
+    ngx_lua_dict_t        *dict;
+    ngx_lua_dict_node_t   *node;
+    ngx_lua_dict_data_t   *data;
+    ngx_lua_dict_value_t  incr, init, value;
+    ngx_lua_dict_shard_t  *shard;
+
+    data = luaL_checkudata(L, 1, LUA_DICT_META);
+    dict = data->dict;
+
+    name.data = (u_char *) luaL_checklstring(L, 2, &name.len);
+
+    if (lua_isnoneornil(L, 3)) {
+        lua_pushinteger(L, 1);
+        lua_replace(L, 3);
+    }
+
+    luaL_checktype(L, 3, LUA_TNUMBER);
+    ngx_lua_dict_check_value(L, 3, &incr);
+
+    init.type = 0;
+
+    if (!lua_isnoneornil(L, 4)) {
+        luaL_checktype(L, 4, LUA_TNUMBER);
+        ngx_lua_dict_check_value(L, 4, &init);
+    }
+
+    expires = ngx_lua_dict_check_ttl(L, 5);
+
+    shard = ngx_lua_dict_shard(dict, &name, &hash);
+
+    ngx_lua_dict_wlock(dict, shard);
+
+    node = ngx_lua_dict_lookup(shard, &name, hash);
+
+    if (node != NULL && ngx_lua_dict_expired(node)) {
+        ngx_lua_dict_remove(dict, shard, node);
+        node = NULL;
+    }
+
+    if (node == NULL) {
+        if (init.type == 0) {
+            ngx_lua_dict_wunlock(dict, shard);
+            return ngx_lua_dict_error(L, "not found");
+        }
+
+        value = init;
+
+    } else {
+        value = node->value;
+
+        if (value.type != NGX_LUA_DICT_INTEGER
+            && value.type != NGX_LUA_DICT_NUMBER)
+        {
+            ngx_lua_dict_wunlock(dict, shard);
+            return ngx_lua_dict_error(L, "not a number");
+        }
+    }
+
+    /* integers add as in Lua, wrapping around on overflow */
+
+    if (value.type == NGX_LUA_DICT_INTEGER
+        && incr.type == NGX_LUA_DICT_INTEGER)
+    {
+        value.u.integer = (int64_t) ((uint64_t) value.u.integer
+                                     + (uint64_t) incr.u.integer);
+
+    } else {
+        if (value.type == NGX_LUA_DICT_INTEGER) {
+            value.u.number = (double) value.u.integer;
+            value.type = NGX_LUA_DICT_NUMBER;
+        }
+
+        value.u.number += (incr.type == NGX_LUA_DICT_INTEGER)
+                          ? (double) incr.u.integer : incr.u.number;
+    }
+
+    ret = NGX_OK;
+
+    if (node == NULL) {
+
+        /* the ttl only applies to a key created here */
+
+        ret = ngx_lua_dict_insert(dict, shard, &name, hash, &value,
+                                  expires);
+
+    } else {
+        node->value = value;
+        ngx_lua_dict_touch(shard, node);
+    }
+
+    ngx_lua_dict_wunlock(dict, shard);
+
+    if (ret != NGX_OK) {
+        return ngx_lua_dict_error(L, "no memory");
+    }
+
+    ngx_lua_dict_push_value(L, &value);
+
+    return 1;
+}
+
+
+static int
+ngx_lua_dict_ttl(lua_State *L)
+{
+    uint64_t              hash;
+    ngx_str_t             name;
+    ngx_msec_t            expires;
+    ngx_lua_dict_t        *dict;
+    ngx_lua_dict_node_t   *node;
+    ngx_lua_dict_data_t   *data;
+    ngx_lua_dict_shard_t  *shard;
+
+    data = luaL_checkudata(L, 1, LUA_DICT_META);
+    dict = data->dict;
+
+    name.data = (u_char *) luaL_checklstring(L, 2, &name.len);
+
+    shard = ngx_lua_dict_shard(dict, &name, &hash);
+
+    ngx_rwlock_rlock(&shard->rwlock);
+
+    node = ngx_lua_dict_lookup(shard, &name, hash);
+
+    if (node == NULL || ngx_lua_dict_expired(node)) {
+        ngx_rwlock_unlock(&shard->rwlock);
+        return ngx_lua_dict_error(L, "not found");
+    }
+
+    expires = node->expires;
+
+    ngx_rwlock_unlock(&shard->rwlock);
+
+    if (expires == 0) {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+
+    lua_pushnumber(L, (lua_Number) (expires - ngx_current_msec) / 1000);
+
+    return 1;
+}
+
+
+static int
+ngx_lua_dict_expire(lua_State *L)
+{
+    uint64_t              hash;
+    ngx_str_t             name;
+    ngx_msec_t            expires;
+    ngx_lua_dict_t        *dict;
+    ngx_lua_dict_node_t   *node;
+    ngx_lua_dict_data_t   *data;
+    ngx_lua_dict_shard_t  *shard;
+
+    data = luaL_checkudata(L, 1, LUA_DICT_META);
+    dict = data->dict;
+
+    name.data = (u_char *) luaL_checklstring(L, 2, &name.len);
+    expires = ngx_lua_dict_check_ttl(L, 3);
+
+    shard = ngx_lua_dict_shard(dict, &name, &hash);
+
+    ngx_lua_dict_wlock(dict, shard);
+
+    node = ngx_lua_dict_lookup(shard, &name, hash);
+
+    if (node != NULL && ngx_lua_dict_expired(node)) {
+        ngx_lua_dict_remove(dict, shard, node);
+        node = NULL;
+    }
+
+    if (node == NULL) {
+        ngx_lua_dict_wunlock(dict, shard);
+        return ngx_lua_dict_error(L, "not found");
+    }
+
+    node->expires = expires;
+
+    ngx_lua_dict_wunlock(dict, shard);
+
+    lua_pushboolean(L, 1);
+
+    return 1;
+}
+
+
+static int
+ngx_lua_dict_stats(lua_State *L)
+{
+    ngx_uint_t           i, evictions;
+    ngx_lua_dict_t       *dict;
+    ngx_lua_dict_data_t  *data;
+
+    data = luaL_checkudata(L, 1, LUA_DICT_META);
+    dict = data->dict;
+
+    /* the counters are read without locking, they only grow */
+
+    evictions = 0;
+
+    for (i = 0; i < dict->sh->nshards; i++) {
+        evictions += dict->sh->shards[i].evictions;
+    }
+
+    lua_createtable(L, 0, 2);
+
+    lua_pushinteger(L, dict->sh->nshards);
+    lua_setfield(L, -2, "shards");
 
-    ngx_rwlock_unlock(&dict->sh->rwlock);
+    lua_pushinteger(L, evictions);
+    lua_setfield(L, -2, "evictions");
 
     return 1;
 }
@@ -1,4 +1,3 @@
-
 /*
  * Copyright (C) Zhidao HONG
  */
@@ -6,21 +5,68 @@
 #ifndef NGX_LUA_DICT_H
 #define NGX_LUA_DICT_H
 
+#define NGX_LUA_DICT_STRING     1
+#define NGX_LUA_DICT_NUMBER     2
+#define NGX_LUA_DICT_INTEGER    3
+#define NGX_LUA_DICT_BOOLEAN    4
+
+typedef struct {
+    ngx_uint_t              type;
+    ngx_str_t               str;
+    union {
+        double              number;
+        int64_t             integer;
+    } u;
+} ngx_lua_dict_value_t;
+
 typedef struct {
-    ngx_str_node_t          sn;
-    ngx_str_t               value;
+    ngx_queue_t             queue;
+    uint64_t                hash;
+    ngx_str_t               key;
+    ngx_msec_t              expires;    /* 0 if the key never expires */
+    ngx_uint_t              accessed;   /* read since it was queued */
+    size_t                  size;       /* allocated with key and value */
+    ngx_lua_dict_value_t    value;
 } ngx_lua_dict_node_t;
 
 typedef struct {
-    ngx_rbtree_t            rbtree;
-    ngx_rbtree_node_t       sentinel;
+    uint64_t                hash;
+    ngx_lua_dict_node_t     *node;      /* NULL if the slot is free */
+} ngx_lua_dict_slot_t;
+
+#define NGX_LUA_DICT_MAX_SHARDS 256
+
+typedef struct {
+    ngx_lua_dict_slot_t     *slots;
+    ngx_uint_t              size;
+    ngx_uint_t              used;
+
+    /* the previous table while it is moved to the new one */
+    ngx_lua_dict_slot_t     *old;
+    ngx_uint_t              old_size;
+    ngx_uint_t              start;
+    ngx_uint_t              moved;
+
+    ngx_queue_t             lru;
+    ngx_uint_t              evictions;
     ngx_atomic_t            rwlock;
+    ngx_atomic_t            seq;        /* odd while a writer is in */
+    /* keeps the locks of neighbouring shards off one cache line */
+    u_char                  pad[NGX_CPU_CACHE_LINE];
+} ngx_lua_dict_shard_t;
+
+typedef struct {
+    ngx_uint_t              nshards;
+    ngx_lua_dict_shard_t    *shards;
+    ngx_uint_t              lockfree;
 } ngx_lua_dict_sh_t;
 
 typedef struct {
     ngx_shm_zone_t          *shm_zone;
     ngx_lua_dict_sh_t       *sh;
     ngx_slab_pool_t         *shpool;
+    ngx_uint_t              nshards;
+    ngx_uint_t              lockfree;
 } ngx_lua_dict_t;
 
 #endif /* NGX_LUA_DICT_H */
@@ -5,21 +5,157 @@
 
 #include <ngx_lua_http.h>
 
+#define LUA_HEADERS_META  "lua_headers_metatable"
+
+#define NGX_LUA_HEADER_LEN      64
+#define NGX_LUA_HEADER_BUCKETS  32
+
+typedef struct {
+    ngx_http_request_t  *request;
+    ngx_list_t          *list;
+    ngx_uint_t          out;
+} ngx_lua_headers_t;
+
+typedef ngx_int_t (*ngx_lua_headers_handler_pt)(ngx_table_elt_t *h,
+    void *data);
+
+typedef struct {
+    lua_State           *state;
+    lua_Integer         n;
+} ngx_lua_headers_collect_t;
+
+typedef ngx_int_t (*ngx_lua_header_update_pt)(ngx_http_request_t *r,
+    ngx_str_t *value);
+
+typedef struct {
+    ngx_str_t                 name;
+    ngx_uint_t                offset;
+    ngx_lua_header_update_pt  update;
+} ngx_lua_header_out_t;
+
+static ngx_table_elt_t **ngx_lua_headers_known(ngx_lua_headers_t *hd,
+    ngx_uint_t key, u_char *lowcase, size_t len);
+static ngx_lua_header_out_t *ngx_lua_headers_out_known(
+    ngx_lua_headers_t *hd, ngx_str_t *name);
+static ngx_int_t ngx_lua_headers_out_update(ngx_lua_headers_t *hd,
+    ngx_str_t *name, ngx_lua_header_out_t *hh, ngx_str_t *value);
+static ngx_int_t ngx_lua_headers_out_link(ngx_table_elt_t *h, void *data);
+static ngx_int_t ngx_lua_headers_content_type(ngx_http_request_t *r,
+    ngx_str_t *value);
+static ngx_int_t ngx_lua_headers_content_length(ngx_http_request_t *r,
+    ngx_str_t *value);
+static ngx_int_t ngx_lua_headers_last_modified(ngx_http_request_t *r,
+    ngx_str_t *value);
+static ngx_int_t ngx_lua_headers_each(ngx_lua_headers_t *hd,
+    ngx_str_t *name, ngx_lua_headers_handler_pt handler, void *data);
+static ngx_int_t ngx_lua_headers_scan(ngx_list_t *list, ngx_str_t *name,
+    ngx_lua_headers_handler_pt handler, void *data);
+static ngx_lua_headers_index_t *ngx_lua_headers_index(ngx_lua_headers_t *hd);
+static ngx_uint_t ngx_lua_headers_index_stale(ngx_lua_headers_index_t *index,
+    ngx_list_t *list);
+static ngx_int_t ngx_lua_headers_rehash(ngx_lua_headers_index_t *index,
+    ngx_pool_t *pool);
+static ngx_int_t ngx_lua_headers_first(ngx_table_elt_t *h, void *data);
+static ngx_int_t ngx_lua_headers_first_value(ngx_table_elt_t *h,
+    void *data);
+static ngx_int_t ngx_lua_headers_collect(ngx_table_elt_t *h, void *data);
+static ngx_int_t ngx_lua_headers_remove(ngx_table_elt_t *h, void *data);
+static ngx_int_t ngx_lua_headers_remove_other(ngx_table_elt_t *h,
+    void *data);
+static ngx_table_elt_t *ngx_lua_headers_append(ngx_lua_headers_t *hd,
+    ngx_str_t *name);
+static ngx_int_t ngx_lua_headers_value(ngx_lua_headers_t *hd,
+    ngx_table_elt_t *h, ngx_str_t *value);
+static ngx_int_t ngx_lua_headers_check(lua_State *L, ngx_lua_headers_t *hd,
+    ngx_lua_header_out_t *hh, ngx_str_t *value);
 static int ngx_lua_headers_get(lua_State *L);
+static int ngx_lua_headers_get_all(lua_State *L);
 static int ngx_lua_headers_set(lua_State *L);
+static int ngx_lua_headers_add(lua_State *L);
+static int ngx_lua_headers_clear(lua_State *L);
+static int ngx_lua_headers_to_table(lua_State *L);
+
+
+/*
+ * Response headers nginx keeps typed pointers or values for; offset 0
+ * marks Content-Type, which lives in headers_out and not in the list.
+ */
+
+static ngx_lua_header_out_t  ngx_lua_headers_out[] = {
+
+    { ngx_string("Server"),
+                 offsetof(ngx_http_headers_out_t, server), NULL },
+
+    { ngx_string("Date"),
+                 offsetof(ngx_http_headers_out_t, date), NULL },
+
+    { ngx_string("Content-Length"),
+                 offsetof(ngx_http_headers_out_t, content_length),
+                 ngx_lua_headers_content_length },
+
+    { ngx_string("Content-Encoding"),
+                 offsetof(ngx_http_headers_out_t, content_encoding), NULL },
+
+    { ngx_string("Location"),
+                 offsetof(ngx_http_headers_out_t, location), NULL },
+
+    { ngx_string("Refresh"),
+                 offsetof(ngx_http_headers_out_t, refresh), NULL },
+
+    { ngx_string("Last-Modified"),
+                 offsetof(ngx_http_headers_out_t, last_modified),
+                 ngx_lua_headers_last_modified },
+
+    { ngx_string("Content-Range"),
+                 offsetof(ngx_http_headers_out_t, content_range), NULL },
+
+    { ngx_string("Accept-Ranges"),
+                 offsetof(ngx_http_headers_out_t, accept_ranges), NULL },
+
+    { ngx_string("WWW-Authenticate"),
+                 offsetof(ngx_http_headers_out_t, www_authenticate), NULL },
+
+    { ngx_string("Expires"),
+                 offsetof(ngx_http_headers_out_t, expires), NULL },
+
+    { ngx_string("ETag"),
+                 offsetof(ngx_http_headers_out_t, etag), NULL },
+
+    { ngx_string("Cache-Control"),
+                 offsetof(ngx_http_headers_out_t, cache_control), NULL },
+
+    { ngx_string("Link"),
+                 offsetof(ngx_http_headers_out_t, link), NULL },
+
+    { ngx_string("Content-Type"), 0, ngx_lua_headers_content_type },
+
+    { ngx_null_string, 0, NULL }
+};
 
 
 void
 ngx_lua_headers_metatable(lua_State *L)
 {
-    luaL_newmetatable(L, "lua_headers_metatable");
+    luaL_newmetatable(L, LUA_HEADERS_META);
 
     lua_pushcfunction(L, ngx_lua_headers_get);
     lua_setfield(L, -2, "get");
 
+    lua_pushcfunction(L, ngx_lua_headers_get_all);
+    lua_setfield(L, -2, "get_all");
+
     lua_pushcfunction(L, ngx_lua_headers_set);
     lua_setfield(L, -2, "set");
 
+    lua_pushcfunction(L, ngx_lua_headers_add);
+    lua_setfield(L, -2, "add");
+
+    lua_pushcfunction(L, ngx_lua_headers_clear);
+    lua_setfield(L, -2, "clear");
+
+    lua_pushcfunction(L, ngx_lua_headers_to_table);
+    lua_setfield(L, -2, "to_table");
+
     lua_pushvalue(L, -1);
     lua_setfield(L, -2, "__index");
 
@@ -27,14 +163,311 @@ ngx_lua_headers_metatable(lua_State *L)
 }
 
 
-static ngx_table_elt_t *
-ngx_lua_header_find(ngx_list_t *headers, ngx_str_t *name)
+ngx_int_t
+ngx_lua_headers_init(ngx_conf_t *cf, ngx_hash_t *hash)
+{
+    ngx_array_t           headers;
+    ngx_hash_key_t        *hk;
+    ngx_hash_init_t       hash_init;
+    ngx_lua_header_out_t  *header;
+
+    if (ngx_array_init(&headers, cf->temp_pool, 16, sizeof(ngx_hash_key_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    for (header = ngx_lua_headers_out; header->name.len; header++) {
+        hk = ngx_array_push(&headers);
+        if (hk == NULL) {
+            return NGX_ERROR;
+        }
+
+        hk->key = header->name;
+        hk->key_hash = ngx_hash_key_lc(header->name.data, header->name.len);
+        hk->value = header;
+    }
+
+    hash_init.hash = hash;
+    hash_init.key = ngx_hash_key_lc;
+    hash_init.max_size = 512;
+    hash_init.bucket_size = ngx_align(64, ngx_cacheline_size);
+    hash_init.name = "lua_headers_out_hash";
+    hash_init.pool = cf->pool;
+    hash_init.temp_pool = NULL;
+
+    return ngx_hash_init(&hash_init, headers.elts, headers.nelts);
+}
+
+
+void
+ngx_lua_headers_push(lua_State *L, ngx_http_request_t *r, ngx_uint_t out)
+{
+    ngx_lua_headers_t  *hd;
+
+    hd = lua_newuserdatauv(L, sizeof(ngx_lua_headers_t), 0);
+
+    hd->request = r;
+    hd->list = out ? &r->headers_out.headers : &r->headers_in.headers;
+    hd->out = out;
+
+    luaL_setmetatable(L, LUA_HEADERS_META);
+}
+
+
+/*
+ * Request headers known to nginx are reached through headers_in_hash
+ * and the typed pointers in r->headers_in, which chain duplicates.
+ */
+
+static ngx_table_elt_t **
+ngx_lua_headers_known(ngx_lua_headers_t *hd, ngx_uint_t key, u_char *lowcase,
+    size_t len)
+{
+    ngx_http_header_t          *hh;
+    ngx_http_core_main_conf_t  *cmcf;
+
+    if (hd->out) {
+        return NULL;
+    }
+
+    cmcf = ngx_http_get_module_main_conf(hd->request, ngx_http_core_module);
+
+    hh = ngx_hash_find(&cmcf->headers_in_hash, key, lowcase, len);
+
+    if (hh == NULL || hh->offset == 0) {
+        return NULL;
+    }
+
+    return (ngx_table_elt_t **) ((char *) &hd->request->headers_in
+                                 + hh->offset);
+}
+
+
+static ngx_lua_header_out_t *
+ngx_lua_headers_out_known(ngx_lua_headers_t *hd, ngx_str_t *name)
+{
+    u_char                    lowcase[NGX_LUA_HEADER_LEN];
+    ngx_uint_t                key;
+    ngx_http_lua_main_conf_t  *lmcf;
+
+    if (!hd->out || name->len > NGX_LUA_HEADER_LEN) {
+        return NULL;
+    }
+
+    lmcf = ngx_http_get_module_main_conf(hd->request, ngx_http_lua_module);
+
+    key = ngx_hash_strlow(lowcase, name->data, name->len);
+
+    return ngx_hash_find(&lmcf->headers_out_hash, key, lowcase, name->len);
+}
+
+
+/*
+ * After a known response header changed in the list, its typed pointer
+ * is relinked to the remaining headers of the name, in list order, and
+ * a value kept outside the list is updated from the first of them.
+ */
+
+static ngx_int_t
+ngx_lua_headers_out_update(ngx_lua_headers_t *hd, ngx_str_t *name,
+    ngx_lua_header_out_t *hh, ngx_str_t *value)
+{
+    ngx_table_elt_t  **ph, **link;
+
+    if (hh->offset) {
+        ph = (ngx_table_elt_t **) ((char *) &hd->request->headers_out
+                                   + hh->offset);
+
+        link = ph;
+        *ph = NULL;
+
+        (void) ngx_lua_headers_each(hd, name, ngx_lua_headers_out_link,
+                                    &link);
+
+        *link = NULL;
+
+        value = (*ph != NULL) ? &(*ph)->value : NULL;
+    }
+
+    if (hh->update == NULL) {
+        return NGX_OK;
+    }
+
+    return hh->update(hd->request, value);
+}
+
+
+static ngx_int_t
+ngx_lua_headers_out_link(ngx_table_elt_t *h, void *data)
+{
+    ngx_table_elt_t  ***link = data;
+
+    **link = h;
+    *link = &h->next;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_lua_headers_content_type(ngx_http_request_t *r, ngx_str_t *value)
+{
+    u_char  *p, *last;
+
+    r->headers_out.content_type_lowcase = NULL;
+
+    if (value == NULL) {
+        r->headers_out.content_type.len = 0;
+        r->headers_out.content_type.data = NULL;
+        r->headers_out.content_type_len = 0;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, value->len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(p, value->data, value->len);
+
+    r->headers_out.content_type.len = value->len;
+    r->headers_out.content_type.data = p;
+
+    /* a type with parameters gets no charset appended by nginx */
+
+    last = ngx_strlchr(p, p + value->len, ';');
+
+    r->headers_out.content_type_len = (last != NULL) ? (size_t) (last - p)
+                                                     : value->len;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_lua_headers_content_length(ngx_http_request_t *r, ngx_str_t *value)
+{
+    off_t  len;
+
+    if (value == NULL) {
+        r->headers_out.content_length_n = -1;
+        return NGX_OK;
+    }
+
+    len = ngx_atoof(value->data, value->len);
+    if (len == NGX_ERROR) {
+        return NGX_DECLINED;
+    }
+
+    r->headers_out.content_length_n = len;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_lua_headers_last_modified(ngx_http_request_t *r, ngx_str_t *value)
+{
+    r->headers_out.last_modified_time = (value != NULL)
+                    ? ngx_parse_http_time(value->data, value->len) : -1;
+
+    return NGX_OK;
+}
+
+
+/* calls the handler for every header of the name until it returns done */
+
+static ngx_int_t
+ngx_lua_headers_each(ngx_lua_headers_t *hd, ngx_str_t *name,
+    ngx_lua_headers_handler_pt handler, void *data)
+{
+    u_char                   lowcase[NGX_LUA_HEADER_LEN];
+    ngx_uint_t               key;
+    ngx_table_elt_t          *h, **ph, content_type;
+    ngx_http_request_t       *r;
+    ngx_lua_header_node_t    *node;
+    ngx_lua_header_out_t     *hh;
+    ngx_lua_headers_index_t  *index;
+
+    ph = NULL;
+
+    if (name->len <= NGX_LUA_HEADER_LEN) {
+        key = ngx_hash_strlow(lowcase, name->data, name->len);
+        ph = ngx_lua_headers_known(hd, key, lowcase, name->len);
+
+    } else {
+        key = ngx_hash_key_lc(name->data, name->len);
+    }
+
+    if (ph != NULL) {
+        for (h = *ph; h; h = h->next) {
+            if (h->hash != 0 && handler(h, data) == NGX_DONE) {
+                return NGX_DONE;
+            }
+        }
+
+        return NGX_OK;
+    }
+
+    hh = ngx_lua_headers_out_known(hd, name);
+
+    /* the element only lives during the call, handlers must not keep it */
+
+    if (hh != NULL && hh->offset == 0) {
+        r = hd->request;
+
+        if (r->headers_out.content_type.len == 0) {
+            return NGX_OK;
+        }
+
+        content_type.hash = 1;
+        content_type.key = hh->name;
+        content_type.value = r->headers_out.content_type;
+        content_type.lowcase_key = NULL;
+        content_type.next = NULL;
+
+        return handler(&content_type, data);
+    }
+
+    index = ngx_lua_headers_index(hd);
+    if (index == NULL) {
+        return ngx_lua_headers_scan(hd->list, name, handler, data);
+    }
+
+    if (index->nnodes == 0) {
+        return NGX_OK;
+    }
+
+    for (node = index->buckets[key & (index->nbuckets - 1)];
+         node;
+         node = node->next)
+    {
+        h = node->header;
+
+        if (node->key == key
+            && h->hash != 0
+            && h->key.len == name->len
+            && ngx_strncasecmp(h->key.data, name->data, name->len) == 0
+            && handler(h, data) == NGX_DONE)
+        {
+            return NGX_DONE;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_lua_headers_scan(ngx_list_t *list, ngx_str_t *name,
+    ngx_lua_headers_handler_pt handler, void *data)
 {
     ngx_uint_t       i;
     ngx_list_part_t  *part;
     ngx_table_elt_t  *header;
 
-    part = &headers->part;
+    part = &list->part;
     header = part->elts;
 
     for (i = 0; /* void */ ; i++) {
@@ -51,33 +484,358 @@ ngx_lua_header_find(ngx_list_t *headers, ngx_str_t *name)
 
         if (header[i].hash != 0
             && name->len == header[i].key.len
-            && ngx_strncasecmp(name->data, header[i].key.data, name->len) == 0)
+            && ngx_strncasecmp(name->data, header[i].key.data, name->len) == 0
+            && handler(&header[i], data) == NGX_DONE)
+        {
+            return NGX_DONE;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * The per-request index is built on first lookup and afterwards only
+ * takes in the headers appended to the list since the previous one.
+ * A list emptied by ngx_http_clean_header() is indexed again.
+ */
+
+static ngx_lua_headers_index_t *
+ngx_lua_headers_index(ngx_lua_headers_t *hd)
+{
+    ngx_uint_t               i;
+    ngx_list_part_t          *part;
+    ngx_table_elt_t          *header;
+    ngx_http_lua_ctx_t       *ctx;
+    ngx_lua_header_node_t    *node, **link;
+    ngx_lua_headers_index_t  *index;
+
+    ctx = ngx_http_get_module_ctx(hd->request, ngx_http_lua_module);
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    index = ctx->headers_index[hd->out];
+
+    if (index == NULL) {
+        index = ngx_pcalloc(hd->request->pool,
+                            sizeof(ngx_lua_headers_index_t));
+        if (index == NULL) {
+            return NULL;
+        }
+
+        index->part = &hd->list->part;
+        index->last = hd->list->last;
+
+        ctx->headers_index[hd->out] = index;
+    }
+
+    if (ngx_lua_headers_index_stale(index, hd->list)) {
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, hd->request->connection->log, 0,
+                       "lua headers index reset");
+
+        if (index->nbuckets) {
+            ngx_memzero(index->buckets,
+                        index->nbuckets * sizeof(ngx_lua_header_node_t *));
+        }
+
+        index->nnodes = 0;
+        index->part = &hd->list->part;
+        index->nelts = 0;
+    }
+
+    part = index->part;
+    header = part->elts;
+
+    for (i = index->nelts; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            header = part->elts;
+            i = 0;
+        }
+
+        if (index->nnodes == index->nbuckets
+            && ngx_lua_headers_rehash(index, hd->request->pool) != NGX_OK)
         {
-            return &header[i];
+            return NULL;
+        }
+
+        node = ngx_palloc(hd->request->pool, sizeof(ngx_lua_header_node_t));
+        if (node == NULL) {
+            return NULL;
         }
+
+        node->header = &header[i];
+        node->key = ngx_hash_key_lc(header[i].key.data, header[i].key.len);
+        node->next = NULL;
+
+        /* appended, so that duplicates are found in list order */
+
+        link = &index->buckets[node->key & (index->nbuckets - 1)];
+
+        while (*link) {
+            link = &(*link)->next;
+        }
+
+        *link = node;
+
+        index->nnodes++;
+        index->part = part;
+        index->nelts = i + 1;
+        index->tail = header[i].key.data;
     }
 
-    return NULL;
+    index->last = hd->list->last;
+
+    return index;
+}
+
+
+static ngx_uint_t
+ngx_lua_headers_index_stale(ngx_lua_headers_index_t *index, ngx_list_t *list)
+{
+    ngx_table_elt_t  *header;
+
+    /* the indexed part lost elements */
+
+    if (index->part->nelts < index->nelts) {
+        return 1;
+    }
+
+    /* the list was cut behind the indexed part */
+
+    if (index->part != &list->part && list->last == &list->part) {
+        return 1;
+    }
+
+    /* a list only grows by linking new parts to its last one */
+
+    if (index->last != list->last && index->last->next == NULL) {
+        return 1;
+    }
+
+    /* the slot of the last indexed header was reused */
+
+    if (index->nelts > 0) {
+        header = index->part->elts;
+
+        if (header[index->nelts - 1].key.data != index->tail) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static ngx_int_t
+ngx_lua_headers_rehash(ngx_lua_headers_index_t *index, ngx_pool_t *pool)
+{
+    ngx_uint_t             i, n;
+    ngx_lua_header_node_t  **buckets, *node, *next, **link;
+
+    n = index->nbuckets ? 2 * index->nbuckets : NGX_LUA_HEADER_BUCKETS;
+
+    buckets = ngx_pcalloc(pool, n * sizeof(ngx_lua_header_node_t *));
+    if (buckets == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* nodes of a new bucket all come from one old bucket, in order */
+
+    for (i = 0; i < index->nbuckets; i++) {
+
+        for (node = index->buckets[i]; node; node = next) {
+            next = node->next;
+            node->next = NULL;
+
+            link = &buckets[node->key & (n - 1)];
+
+            while (*link) {
+                link = &(*link)->next;
+            }
+
+            *link = node;
+        }
+    }
+
+    index->buckets = buckets;
+    index->nbuckets = n;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_lua_headers_first(ngx_table_elt_t *h, void *data)
+{
+    ngx_table_elt_t  **hp = data;
+
+    *hp = h;
+
+    return NGX_DONE;
+}
+
+
+static ngx_int_t
+ngx_lua_headers_first_value(ngx_table_elt_t *h, void *data)
+{
+    ngx_str_t  *value = data;
+
+    *value = h->value;
+
+    return NGX_DONE;
+}
+
+
+static ngx_int_t
+ngx_lua_headers_collect(ngx_table_elt_t *h, void *data)
+{
+    ngx_lua_headers_collect_t  *col = data;
+
+    lua_pushlstring(col->state, (const char *) h->value.data, h->value.len);
+    lua_rawseti(col->state, -2, ++col->n);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_lua_headers_remove(ngx_table_elt_t *h, void *data)
+{
+    h->hash = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_lua_headers_remove_other(ngx_table_elt_t *h, void *data)
+{
+    if (h != data) {
+        h->hash = 0;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_table_elt_t *
+ngx_lua_headers_append(ngx_lua_headers_t *hd, ngx_str_t *name)
+{
+    ngx_uint_t       key;
+    ngx_pool_t       *pool;
+    ngx_table_elt_t  *h, **ph;
+
+    pool = hd->request->pool;
+
+    h = ngx_list_push(hd->list);
+    if (h == NULL) {
+        return NULL;
+    }
+
+    h->key.len = name->len;
+
+    h->key.data = ngx_pnalloc(pool, name->len);
+    if (h->key.data == NULL) {
+        return NULL;
+    }
+
+    ngx_memcpy(h->key.data, name->data, name->len);
+
+    h->lowcase_key = ngx_pnalloc(pool, name->len);
+    if (h->lowcase_key == NULL) {
+        return NULL;
+    }
+
+    key = ngx_hash_strlow(h->lowcase_key, name->data, name->len);
+
+    h->hash = key ? key : 1;
+    h->next = NULL;
+
+    h->value.len = 0;
+    h->value.data = NULL;
+
+    /* a new known request header joins its typed pointer chain */
+
+    ph = ngx_lua_headers_known(hd, key, h->lowcase_key, name->len);
+
+    if (ph != NULL) {
+        while (*ph) {
+            ph = &(*ph)->next;
+        }
+
+        *ph = h;
+    }
+
+    return h;
+}
+
+
+static ngx_int_t
+ngx_lua_headers_value(ngx_lua_headers_t *hd, ngx_table_elt_t *h,
+    ngx_str_t *value)
+{
+    h->value.data = ngx_pnalloc(hd->request->pool, value->len);
+    if (h->value.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(h->value.data, value->data, value->len);
+    h->value.len = value->len;
+
+    return NGX_OK;
 }
 
 
 static int
 ngx_lua_headers_get(lua_State *L)
 {
-    ngx_str_t        name;
-    ngx_list_t       *headers;
-    ngx_table_elt_t  *h;
+    ngx_str_t          name, value;
+    ngx_lua_headers_t  *hd;
 
-    headers = lua_touserdata(L, 1);
+    hd = luaL_checkudata(L, 1, LUA_HEADERS_META);
 
     name.data = (u_char *) luaL_checklstring(L, 2, &name.len);
 
-    h = ngx_lua_header_find(headers, &name);
-    if (h == NULL) {
+    value.data = NULL;
+
+    if (ngx_lua_headers_each(hd, &name, ngx_lua_headers_first_value, &value)
+        != NGX_DONE)
+    {
         return 0;
     }
 
-    lua_pushlstring(L, (const char *) h->value.data, h->value.len);
+    lua_pushlstring(L, (const char *) value.data, value.len);
+
+    return 1;
+}
+
+
+static int
+ngx_lua_headers_get_all(lua_State *L)
+{
+    ngx_str_t                  name;
+    ngx_lua_headers_t          *hd;
+    ngx_lua_headers_collect_t  col;
+
+    hd = luaL_checkudata(L, 1, LUA_HEADERS_META);
+
+    name.data = (u_char *) luaL_checklstring(L, 2, &name.len);
+
+    lua_newtable(L);
+
+    col.state = L;
+    col.n = 0;
+
+    (void) ngx_lua_headers_each(hd, &name, ngx_lua_headers_collect, &col);
 
     return 1;
 }
@@ -86,42 +844,63 @@ ngx_lua_headers_get(lua_State *L)
 static int
 ngx_lua_headers_set(lua_State *L)
 {
-    ngx_str_t        name, value;
-    ngx_list_t       *headers;
-    ngx_table_elt_t  *h;
+    u_char                lowcase[NGX_LUA_HEADER_LEN];
+    ngx_str_t             name, value;
+    ngx_uint_t            key;
+    ngx_table_elt_t       *h, **ph;
+    ngx_lua_headers_t     *hd;
+    ngx_lua_header_out_t  *hh;
 
-    headers = lua_touserdata(L, 1);
+    hd = luaL_checkudata(L, 1, LUA_HEADERS_META);
 
     name.data = (u_char *) luaL_checklstring(L, 2, &name.len);
     value.data = (u_char *) luaL_checklstring(L, 3, &value.len);
 
-    h = ngx_lua_header_find(headers, &name);
+    hh = ngx_lua_headers_out_known(hd, &name);
+
+    if (ngx_lua_headers_check(L, hd, hh, &value) == NGX_DONE) {
+        return 0;
+    }
+
+    h = NULL;
+
+    (void) ngx_lua_headers_each(hd, &name, ngx_lua_headers_first, &h);
 
     if (h == NULL) {
-        h = ngx_list_push(headers);
+        h = ngx_lua_headers_append(hd, &name);
         if (h == NULL) {
             goto fail;
         }
 
-        h->key.len = name.len;
+    } else {
 
-        h->key.data = ngx_pnalloc(headers->pool, name.len);
-        if (h->key.data == NULL) {
-            goto fail;
-        }
+        /* the first header takes the value, the others go */
 
-        ngx_memcpy(h->key.data, name.data, name.len);
-    }
+        (void) ngx_lua_headers_each(hd, &name, ngx_lua_headers_remove_other,
+                                    h);
 
-    h->hash = 1;
-    h->value.len = value.len;
+        /* a known request header is left alone in its typed pointer */
 
-    h->value.data = ngx_pnalloc(headers->pool, value.len);
-    if (h->value.data == NULL) {
+        if (name.len <= NGX_LUA_HEADER_LEN) {
+            key = ngx_hash_strlow(lowcase, name.data, name.len);
+            ph = ngx_lua_headers_known(hd, key, lowcase, name.len);
+
+            if (ph != NULL) {
+                *ph = h;
+                h->next = NULL;
+            }
+        }
+    }
+
+    if (ngx_lua_headers_value(hd, h, &value) != NGX_OK) {
         goto fail;
     }
 
-    ngx_memcpy(h->value.data, value.data, value.len);
+    if (hh != NULL
+        && ngx_lua_headers_out_update(hd, &name, hh, NULL) != NGX_OK)
+    {
+        goto fail;
+    }
 
     return 0;
 
@@ -129,3 +908,198 @@ fail:
 
     return luaL_error(L, "headers set failed.");
 }
+
+
+static int
+ngx_lua_headers_add(lua_State *L)
+{
+    ngx_str_t             name, value;
+    ngx_table_elt_t       *h;
+    ngx_lua_headers_t     *hd;
+    ngx_lua_header_out_t  *hh;
+
+    hd = luaL_checkudata(L, 1, LUA_HEADERS_META);
+
+    name.data = (u_char *) luaL_checklstring(L, 2, &name.len);
+    value.data = (u_char *) luaL_checklstring(L, 3, &value.len);
+
+    hh = ngx_lua_headers_out_known(hd, &name);
+
+    if (ngx_lua_headers_check(L, hd, hh, &value) == NGX_DONE) {
+        return 0;
+    }
+
+    h = ngx_lua_headers_append(hd, &name);
+
+    if (h == NULL
+        || ngx_lua_headers_value(hd, h, &value) != NGX_OK
+        || (hh != NULL
+            && ngx_lua_headers_out_update(hd, &name, hh, NULL) != NGX_OK))
+    {
+        return luaL_error(L, "headers add failed.");
+    }
+
+    return 0;
+}
+
+
+/*
+ * Rejects a value nginx could not use for a known response header
+ * before it reaches the list; Content-Type is set here and done.
+ */
+
+static ngx_int_t
+ngx_lua_headers_check(lua_State *L, ngx_lua_headers_t *hd,
+    ngx_lua_header_out_t *hh, ngx_str_t *value)
+{
+    ngx_int_t  rc;
+
+    if (hh == NULL || hh->update == NULL) {
+        return NGX_OK;
+    }
+
+    rc = hh->update(hd->request, value);
+
+    if (rc == NGX_DECLINED) {
+        luaL_error(L, "invalid \"%s\" header value", hh->name.data);
+    }
+
+    if (rc != NGX_OK) {
+        luaL_error(L, "headers set failed.");
+    }
+
+    return (hh->offset == 0) ? NGX_DONE : NGX_OK;
+}
+
+
+static int
+ngx_lua_headers_clear(lua_State *L)
+{
+    u_char                lowcase[NGX_LUA_HEADER_LEN];
+    ngx_str_t             name;
+    ngx_uint_t            key;
+    ngx_table_elt_t       **ph;
+    ngx_lua_headers_t     *hd;
+    ngx_lua_header_out_t  *hh;
+
+    hd = luaL_checkudata(L, 1, LUA_HEADERS_META);
+
+    name.data = (u_char *) luaL_checklstring(L, 2, &name.len);
+
+    (void) ngx_lua_headers_each(hd, &name, ngx_lua_headers_remove, NULL);
+
+    hh = ngx_lua_headers_out_known(hd, &name);
+
+    if (hh != NULL) {
+        if (ngx_lua_headers_out_update(hd, &name, hh, NULL) != NGX_OK) {
+            return luaL_error(L, "headers clear failed.");
+        }
+
+        return 0;
+    }
+
+    /* a cleared known request header no longer has a typed pointer */
+
+    if (name.len <= NGX_LUA_HEADER_LEN) {
+        key = ngx_hash_strlow(lowcase, name.data, name.len);
+        ph = ngx_lua_headers_known(hd, key, lowcase, name.len);
+
+        if (ph != NULL) {
+            *ph = NULL;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * All headers in one pass, keyed by lowercase name; a repeated header
+ * becomes an array of its values in list order.
+ */
+
+static int
+ngx_lua_headers_to_table(lua_State *L)
+{
+    u_char             *p;
+    ngx_uint_t         i, n;
+    ngx_str_t          *type;
+    luaL_Buffer        b;
+    ngx_list_part_t    *part;
+    ngx_table_elt_t    *header;
+    ngx_lua_headers_t  *hd;
+
+    hd = luaL_checkudata(L, 1, LUA_HEADERS_META);
+
+    n = 0;
+
+    for (part = &hd->list->part; part; part = part->next) {
+        n += part->nelts;
+    }
+
+    lua_createtable(L, 0, n);
+
+    part = &hd->list->part;
+    header = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            header = part->elts;
+            i = 0;
+        }
+
+        if (header[i].hash == 0) {
+            continue;
+        }
+
+        p = (u_char *) luaL_buffinitsize(L, &b, header[i].key.len);
+        ngx_strlow(p, header[i].key.data, header[i].key.len);
+        luaL_pushresultsize(&b, header[i].key.len);
+
+        lua_pushvalue(L, -1);
+
+        switch (lua_rawget(L, -3)) {
+
+        case LUA_TNIL:
+            lua_pop(L, 1);
+            lua_pushlstring(L, (const char *) header[i].value.data,
+                            header[i].value.len);
+            lua_rawset(L, -3);
+            break;
+
+        case LUA_TSTRING:
+            lua_createtable(L, 2, 0);
+            lua_insert(L, -2);
+            lua_rawseti(L, -2, 1);
+            lua_pushlstring(L, (const char *) header[i].value.data,
+                            header[i].value.len);
+            lua_rawseti(L, -2, 2);
+            lua_rawset(L, -3);
+            break;
+
+        default: /* LUA_TTABLE */
+            lua_pushlstring(L, (const char *) header[i].value.data,
+                            header[i].value.len);
+            lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+            lua_pop(L, 2);
+            break;
+        }
+    }
+
+    /* Content-Type of a response is not in the list */
+
+    type = &hd->request->headers_out.content_type;
+
+    if (hd->out && type->len) {
+        lua_pushlstring(L, (const char *) type->data, type->len);
+        lua_setfield(L, -2, "content-type");
+    }
+
+    return 1;
+}
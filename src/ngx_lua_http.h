@@ -10,22 +10,88 @@
 #include <ngx_http.h>
 
 typedef struct {
-    ngx_lua_t       *lua;
-    int             request_ref;
-    ngx_array_t     *dicts;   /* of ngx_lua_dict_t */
-    ngx_array_t     *timers;  /* of ngx_lua_timer_t */
+    ngx_lua_t          *lua;
+    int                request_ref;
+    ngx_array_t        *dicts;   /* of ngx_lua_dict_t */
+    ngx_array_t        *timers;  /* of ngx_lua_timer_t */
+    ngx_uint_t         thread_pool_size;
+    ngx_flag_t         ctx_recycle;
+    ngx_str_t          bytecode_cache;
+    ngx_uint_t         bytecode_hits;
+    ngx_uint_t         bytecode_misses;
+    ngx_rbtree_t       chunks;
+    ngx_rbtree_node_t  chunks_sentinel;
+    ngx_array_t        *files;   /* of ngx_http_lua_file_t * */
+    time_t             check_interval;
+    ngx_hash_t         headers_out_hash;
 } ngx_http_lua_main_conf_t;
 
+typedef struct ngx_lua_header_node_s  ngx_lua_header_node_t;
+
+struct ngx_lua_header_node_s {
+    ngx_table_elt_t        *header;
+    ngx_uint_t             key;
+    ngx_lua_header_node_t  *next;
+};
+
+typedef struct {
+    ngx_lua_header_node_t  **buckets;
+    ngx_uint_t             nbuckets;
+    ngx_uint_t             nnodes;
+    ngx_list_part_t        *part;    /* indexed up to part->elts[nelts] */
+    ngx_uint_t             nelts;
+    ngx_list_part_t        *last;    /* list->last when indexed */
+    u_char                 *tail;    /* key.data of the last indexed one */
+} ngx_lua_headers_index_t;
+
 typedef struct {
-    ngx_lua_t       *lua;
-    ngx_uint_t      status;
-    ngx_buf_t       *buf;
+    ngx_lua_t                *lua;
+    ngx_uint_t               phase;
+    ngx_uint_t               done;
+    ngx_uint_t               status;
+    ngx_chain_t              *out;
+    ngx_chain_t              **last_out;
+    ngx_chain_t              *free;
+    ngx_chain_t              *busy;
+    ngx_lua_t                *filter;      /* runs lua_body_filter */
+    ngx_chain_t              *filter_free;
+    ngx_chain_t              *filter_busy;
+    int                      pins_ref;
+    ngx_uint_t               npins;
+    int                      cache_ref;
+    int                      ctx_ref;
+    ngx_str_t                uri;     /* r->uri behind the cached r.uri */
+    ngx_str_t                args;    /* r->args behind r.get_args() */
+    lua_Integer              args_max;
+    lua_Integer              post_args_max;
+    ngx_lua_headers_index_t  *headers_index[2];
+    ngx_event_t              resume;
+    size_t                   body_chunk;
+    unsigned                 exited:1;
+    unsigned                 stream:1;
 } ngx_http_lua_ctx_t;
 
 void ngx_lua_request_metatable(lua_State *L);
 void ngx_lua_headers_metatable(lua_State *L);
 void ngx_lua_response_metatable(lua_State *L);
+ngx_int_t ngx_lua_headers_init(ngx_conf_t *cf, ngx_hash_t *hash);
+void ngx_lua_headers_push(lua_State *L, ngx_http_request_t *r,
+    ngx_uint_t out);
+void ngx_lua_response_push(lua_State *L, ngx_http_request_t *r);
+void ngx_lua_body_metatable(lua_State *L);
+void ngx_lua_multipart_metatable(lua_State *L);
+int ngx_lua_multipart_open(lua_State *L);
+int ngx_lua_body_view(lua_State *L, ngx_http_request_t *r);
 int ngx_lua_http_request_object(lua_State *L);
+void ngx_lua_request_var_index_register(lua_State *L,
+    ngx_array_t *variables);
+ngx_int_t ngx_lua_request_body_chunk(lua_State *L, ngx_http_request_t *r,
+    ngx_http_lua_ctx_t *ctx, size_t size);
+ngx_int_t ngx_lua_response_send_header(ngx_http_request_t *r,
+    ngx_http_lua_ctx_t *ctx, ngx_uint_t last);
+ngx_int_t ngx_lua_response_output(lua_State *L, ngx_http_request_t *r,
+    ngx_http_lua_ctx_t *ctx, ngx_uint_t flags);
+void ngx_lua_response_flush_handler(ngx_http_request_t *r);
 
 extern ngx_module_t  ngx_http_lua_module;
 
@@ -0,0 +1,602 @@
+
+/*
+ * Copyright (C) Zhidao HONG
+ */
+
+#include <ngx_lua_http.h>
+
+#define LUA_MULTIPART_META  "multipart.meta"
+
+#define NGX_LUA_MULTIPART_CHUNK         8192
+#define NGX_LUA_MULTIPART_MAX_BOUNDARY  70
+#define NGX_LUA_MULTIPART_MAX_HEADER    8192
+
+#define NGX_LUA_MULTIPART_PREAMBLE      0
+#define NGX_LUA_MULTIPART_BOUNDARY      1
+#define NGX_LUA_MULTIPART_HEADERS       2
+#define NGX_LUA_MULTIPART_BODY          3
+#define NGX_LUA_MULTIPART_DONE          4
+
+typedef struct {
+    ngx_http_request_t  *request;
+    ngx_http_lua_ctx_t  *ctx;
+
+    /* "\r\n--" and the boundary */
+    u_char              delimiter[NGX_LUA_MULTIPART_MAX_BOUNDARY + 4];
+    size_t              len;
+
+    ngx_uint_t          state;
+    size_t              size;
+    ngx_buf_t           buffer;
+
+    /* where a read body continues */
+    ngx_chain_t         *cl;
+    off_t               offset;
+
+    unsigned            eof:1;
+} ngx_lua_multipart_t;
+
+static ngx_int_t ngx_lua_multipart_boundary(ngx_lua_multipart_t *mp,
+    ngx_str_t *type);
+static int ngx_lua_multipart_read(lua_State *L);
+static int ngx_lua_multipart_read_k(lua_State *L, int status,
+    lua_KContext kctx);
+static int ngx_lua_multipart_next(lua_State *L, ngx_lua_multipart_t *mp);
+static int ngx_lua_multipart_parse(lua_State *L, ngx_lua_multipart_t *mp);
+static ngx_int_t ngx_lua_multipart_fill(lua_State *L,
+    ngx_lua_multipart_t *mp);
+static ngx_int_t ngx_lua_multipart_append(ngx_lua_multipart_t *mp, u_char *p,
+    size_t len);
+static u_char *ngx_lua_multipart_find(u_char *p, u_char *last, u_char *s,
+    size_t len);
+static void ngx_lua_multipart_free(ngx_lua_multipart_t *mp);
+
+static const struct luaL_Reg  ngx_lua_multipart_methods[] = {
+    {"read", ngx_lua_multipart_read},
+    {NULL, NULL},
+};
+
+
+void
+ngx_lua_multipart_metatable(lua_State *L)
+{
+    luaL_newmetatable(L, LUA_MULTIPART_META);
+
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+
+    luaL_setfuncs(L, ngx_lua_multipart_methods, 0);
+
+    lua_pop(L, 1);
+}
+
+
+int
+ngx_lua_multipart_open(lua_State *L)
+{
+    ngx_lua_t            *lua;
+    lua_Integer          size;
+    ngx_http_request_t   *r;
+    ngx_http_lua_ctx_t   *ctx;
+    ngx_lua_multipart_t  *mp;
+
+    size = luaL_optinteger(L, 1, NGX_LUA_MULTIPART_CHUNK);
+
+    if (size <= 0) {
+        return luaL_error(L, "size is out of range");
+    }
+
+    lua = ngx_lua_ext_get(L);
+    r = lua->data;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
+    if (ctx == NULL || ctx->lua != lua) {
+        return luaL_error(L, "not allowed here");
+    }
+
+    if (!ctx->stream && (r->request_body == NULL || r->reading_body)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "request body is not read");
+        return 2;
+    }
+
+    mp = lua_newuserdatauv(L, sizeof(ngx_lua_multipart_t), 0);
+
+    ngx_memzero(mp, sizeof(ngx_lua_multipart_t));
+
+    luaL_setmetatable(L, LUA_MULTIPART_META);
+
+    if (r->headers_in.content_type == NULL
+        || ngx_lua_multipart_boundary(mp, &r->headers_in.content_type->value)
+           != NGX_OK)
+    {
+        lua_pushnil(L);
+        lua_pushliteral(L, "request body is not multipart");
+        return 2;
+    }
+
+    mp->request = r;
+    mp->ctx = ctx;
+    mp->size = size;
+    mp->state = NGX_LUA_MULTIPART_PREAMBLE;
+
+    if (!ctx->stream) {
+        mp->cl = r->request_body->bufs;
+    }
+
+    /* the first boundary is not preceded by a line break, supply one */
+
+    if (ngx_lua_multipart_append(mp, (u_char *) CRLF, 2) != NGX_OK) {
+        return luaL_error(L, "multipart failed");
+    }
+
+    return 1;
+}
+
+
+static ngx_int_t
+ngx_lua_multipart_boundary(ngx_lua_multipart_t *mp, ngx_str_t *type)
+{
+    u_char  *p, *last, *end;
+
+    last = type->data + type->len;
+
+    if (type->len < sizeof("multipart/") - 1
+        || ngx_strncasecmp(type->data, (u_char *) "multipart/",
+                           sizeof("multipart/") - 1)
+           != 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    p = ngx_strlcasestrn(type->data, last, (u_char *) "boundary=", 9 - 1);
+    if (p == NULL) {
+        return NGX_DECLINED;
+    }
+
+    p += sizeof("boundary=") - 1;
+
+    if (p < last && *p == '"') {
+        p++;
+        end = ngx_strlchr(p, last, '"');
+
+    } else {
+        end = ngx_strlchr(p, last, ';');
+    }
+
+    if (end == NULL) {
+        end = last;
+    }
+
+    while (end > p && end[-1] == ' ') {
+        end--;
+    }
+
+    if (end == p || end - p > NGX_LUA_MULTIPART_MAX_BOUNDARY) {
+        return NGX_DECLINED;
+    }
+
+    mp->len = ngx_cpymem(ngx_cpymem(mp->delimiter, CRLF "--", 4), p, end - p)
+              - mp->delimiter;
+
+    return NGX_OK;
+}
+
+
+/*
+ * Returns the next item of the body:
+ *
+ *     "header", name, value
+ *     "body", data
+ *     "part_end"
+ *     "eof"
+ *
+ * or nil and an error.
+ */
+
+static int
+ngx_lua_multipart_read(lua_State *L)
+{
+    ngx_lua_multipart_t  *mp;
+
+    mp = luaL_checkudata(L, 1, LUA_MULTIPART_META);
+
+    if (mp->request != ((ngx_lua_t *) ngx_lua_ext_get(L))->data
+        || mp->ctx != ngx_http_get_module_ctx(mp->request, ngx_http_lua_module))
+    {
+        return luaL_error(L, "multipart of another request");
+    }
+
+    lua_settop(L, 1);
+
+    return ngx_lua_multipart_next(L, mp);
+}
+
+
+/* resumed with a streamed chunk, nil at its end, or nil and an error */
+
+static int
+ngx_lua_multipart_read_k(lua_State *L, int status, lua_KContext kctx)
+{
+    size_t               len;
+    u_char               *p;
+    ngx_lua_multipart_t  *mp;
+
+    mp = lua_touserdata(L, 1);
+
+    if (lua_gettop(L) > 2) {
+        return 2;
+    }
+
+    if (lua_isnil(L, 2)) {
+        mp->eof = 1;
+
+    } else {
+        p = (u_char *) lua_tolstring(L, 2, &len);
+
+        if (ngx_lua_multipart_append(mp, p, len) != NGX_OK) {
+            return luaL_error(L, "multipart failed");
+        }
+    }
+
+    lua_settop(L, 1);
+
+    return ngx_lua_multipart_next(L, mp);
+}
+
+
+static int
+ngx_lua_multipart_next(lua_State *L, ngx_lua_multipart_t *mp)
+{
+    int        n;
+    ngx_int_t  rc;
+
+    for ( ;; ) {
+        n = ngx_lua_multipart_parse(L, mp);
+
+        if (n > 0) {
+            return n;
+        }
+
+        if (mp->eof) {
+            lua_pushnil(L);
+            lua_pushliteral(L, "truncated body");
+            return 2;
+        }
+
+        rc = ngx_lua_multipart_fill(L, mp);
+
+        if (rc == NGX_ERROR) {
+            return 2;
+        }
+
+        if (rc == NGX_AGAIN) {
+            return lua_yieldk(L, 0, 0, ngx_lua_multipart_read_k);
+        }
+    }
+}
+
+
+/* pushes the next item and returns their number, or 0 if more input is due */
+
+static int
+ngx_lua_multipart_parse(lua_State *L, ngx_lua_multipart_t *mp)
+{
+    u_char     *p, *last, *colon, *value;
+    size_t     keep;
+    ngx_buf_t  *b;
+
+    b = &mp->buffer;
+
+    for ( ;; ) {
+
+        last = b->last;
+
+        switch (mp->state) {
+
+        case NGX_LUA_MULTIPART_PREAMBLE:
+            p = ngx_lua_multipart_find(b->pos, last, mp->delimiter, mp->len);
+
+            if (p == NULL) {
+                keep = ngx_min((size_t) (last - b->pos), mp->len - 1);
+                b->pos = last - keep;
+                return 0;
+            }
+
+            b->pos = p + mp->len;
+            mp->state = NGX_LUA_MULTIPART_BOUNDARY;
+            break;
+
+        case NGX_LUA_MULTIPART_BOUNDARY:
+
+            if (last - b->pos >= 2 && b->pos[0] == '-' && b->pos[1] == '-') {
+                b->pos = last;
+                mp->state = NGX_LUA_MULTIPART_DONE;
+                break;
+            }
+
+            /* transport padding may follow the boundary */
+
+            p = ngx_lua_multipart_find(b->pos, last, (u_char *) CRLF, 2);
+
+            if (p == NULL) {
+                if (last - b->pos > NGX_LUA_MULTIPART_MAX_HEADER) {
+                    lua_pushnil(L);
+                    lua_pushliteral(L, "invalid boundary");
+                    return 2;
+                }
+
+                return 0;
+            }
+
+            b->pos = p + 2;
+            mp->state = NGX_LUA_MULTIPART_HEADERS;
+            break;
+
+        case NGX_LUA_MULTIPART_HEADERS:
+            p = ngx_lua_multipart_find(b->pos, last, (u_char *) CRLF, 2);
+
+            if (p == NULL) {
+                if (last - b->pos > NGX_LUA_MULTIPART_MAX_HEADER) {
+                    lua_pushnil(L);
+                    lua_pushliteral(L, "header is too long");
+                    return 2;
+                }
+
+                return 0;
+            }
+
+            if (p == b->pos) {
+                b->pos = p + 2;
+                mp->state = NGX_LUA_MULTIPART_BODY;
+                break;
+            }
+
+            colon = ngx_strlchr(b->pos, p, ':');
+
+            if (colon == NULL) {
+                lua_pushnil(L);
+                lua_pushliteral(L, "invalid header");
+                return 2;
+            }
+
+            for (value = colon + 1; value < p && *value == ' '; value++) {
+                /* void */
+            }
+
+            lua_pushliteral(L, "header");
+            lua_pushlstring(L, (char *) b->pos, colon - b->pos);
+            lua_pushlstring(L, (char *) value, p - value);
+
+            b->pos = p + 2;
+
+            return 3;
+
+        case NGX_LUA_MULTIPART_BODY:
+            p = ngx_lua_multipart_find(b->pos, last, mp->delimiter, mp->len);
+
+            if (p == b->pos) {
+                b->pos = p + mp->len;
+                mp->state = NGX_LUA_MULTIPART_BOUNDARY;
+
+                lua_pushliteral(L, "part_end");
+                return 1;
+            }
+
+            /* the tail that may start a delimiter is kept back */
+
+            if (p == NULL) {
+                keep = ngx_min((size_t) (last - b->pos), mp->len - 1);
+                p = last - keep;
+
+                if (p == b->pos) {
+                    return 0;
+                }
+            }
+
+            if ((size_t) (p - b->pos) > mp->size) {
+                p = b->pos + mp->size;
+            }
+
+            lua_pushliteral(L, "body");
+            lua_pushlstring(L, (char *) b->pos, p - b->pos);
+
+            b->pos = p;
+
+            return 2;
+
+        default: /* NGX_LUA_MULTIPART_DONE */
+            ngx_lua_multipart_free(mp);
+
+            lua_pushliteral(L, "eof");
+            return 1;
+        }
+    }
+}
+
+
+/*
+ * Takes in more of the body: from the buffers of a read body, or as a
+ * streamed chunk, for which the script may have to yield.
+ */
+
+static ngx_int_t
+ngx_lua_multipart_fill(lua_State *L, ngx_lua_multipart_t *mp)
+{
+    u_char     *p;
+    size_t     len, size;
+    ssize_t    n;
+    ngx_int_t  rc;
+    ngx_buf_t  *buf;
+
+    if (mp->ctx->stream) {
+        rc = ngx_lua_request_body_chunk(L, mp->request, mp->ctx, mp->size);
+
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        if (lua_isnil(L, -1)) {
+            mp->eof = 1;
+
+        } else {
+            p = (u_char *) lua_tolstring(L, -1, &len);
+
+            if (ngx_lua_multipart_append(mp, p, len) != NGX_OK) {
+                luaL_error(L, "multipart failed");
+            }
+        }
+
+        lua_pop(L, 1);
+
+        return NGX_OK;
+    }
+
+    while (mp->cl != NULL) {
+        buf = mp->cl->buf;
+
+        if (ngx_buf_in_memory(buf)) {
+            len = buf->last - buf->pos - (size_t) mp->offset;
+            p = buf->pos + mp->offset;
+
+        } else {
+            len = (size_t) (buf->file_last - buf->file_pos - mp->offset);
+            p = NULL;
+        }
+
+        if (len == 0) {
+            mp->cl = mp->cl->next;
+            mp->offset = 0;
+            continue;
+        }
+
+        size = ngx_min(len, mp->size);
+
+        if (p != NULL) {
+            rc = ngx_lua_multipart_append(mp, p, size);
+
+        } else {
+            rc = ngx_lua_multipart_append(mp, NULL, size);
+
+            if (rc == NGX_OK) {
+                n = ngx_read_file(buf->file, mp->buffer.last - size, size,
+                                  buf->file_pos + mp->offset);
+
+                if (n != (ssize_t) size) {
+                    lua_pushnil(L);
+                    lua_pushliteral(L, "read failed");
+                    return NGX_ERROR;
+                }
+            }
+        }
+
+        if (rc != NGX_OK) {
+            luaL_error(L, "multipart failed");
+        }
+
+        mp->offset += size;
+
+        return NGX_OK;
+    }
+
+    mp->eof = 1;
+
+    return NGX_OK;
+}
+
+
+/* appends len bytes, or makes room for them if p is NULL */
+
+static ngx_int_t
+ngx_lua_multipart_append(ngx_lua_multipart_t *mp, u_char *p, size_t len)
+{
+    u_char     *start;
+    size_t     used, size;
+    ngx_buf_t  *b;
+
+    b = &mp->buffer;
+
+    used = b->last - b->pos;
+
+    if ((size_t) (b->end - b->last) < len) {
+
+        if (b->pos > b->start) {
+            b->last = ngx_movemem(b->start, b->pos, used);
+            b->pos = b->start;
+        }
+
+        if ((size_t) (b->end - b->last) < len) {
+            size = ngx_max(used + len, 2 * (size_t) (b->end - b->start));
+
+            /* the request pool frees it even if the reader is dropped */
+
+            start = ngx_palloc(mp->request->pool, size);
+            if (start == NULL) {
+                return NGX_ERROR;
+            }
+
+            if (used) {
+                ngx_memcpy(start, b->pos, used);
+            }
+
+            if (b->start) {
+                (void) ngx_pfree(mp->request->pool, b->start);
+            }
+
+            b->start = start;
+            b->pos = start;
+            b->last = start + used;
+            b->end = start + size;
+        }
+    }
+
+    if (p != NULL) {
+        ngx_memcpy(b->last, p, len);
+    }
+
+    b->last += len;
+
+    return NGX_OK;
+}
+
+
+static u_char *
+ngx_lua_multipart_find(u_char *p, u_char *last, u_char *s, size_t len)
+{
+    if ((size_t) (last - p) < len) {
+        return NULL;
+    }
+
+    last -= len - 1;
+
+    while (p < last) {
+        p = ngx_strlchr(p, last, s[0]);
+
+        if (p == NULL) {
+            return NULL;
+        }
+
+        if (ngx_memcmp(p, s, len) == 0) {
+            return p;
+        }
+
+        p++;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_lua_multipart_free(ngx_lua_multipart_t *mp)
+{
+    ngx_buf_t  *b;
+
+    b = &mp->buffer;
+
+    if (b->start != NULL) {
+        (void) ngx_pfree(mp->request->pool, b->start);
+        ngx_memzero(b, sizeof(ngx_buf_t));
+    }
+}
@@ -4,8 +4,11 @@
  */
 
 #include <ngx_lua_core.h>
+#include <ngx_lua_http.h>
 
 static void ngx_lua_base64_register(lua_State *L);
+static void ngx_lua_stats_register(lua_State *L);
+static void ngx_lua_sleep_register(lua_State *L);
 
 
 void
@@ -17,7 +20,10 @@ ngx_lua_nginx_register(lua_State *L)
     ngx_lua_json_register(L);
     ngx_lua_dict_register(L);
     ngx_lua_cidr_register(L);
+    ngx_lua_socket_register(L);
     ngx_lua_base64_register(L);
+    ngx_lua_stats_register(L);
+    ngx_lua_sleep_register(L);
 
     lua_setglobal(L, "ngx");
 }
@@ -91,3 +97,89 @@ ngx_lua_base64_register(lua_State *L)
 {
     luaL_setfuncs(L, lua_base64_methods, 0);
 }
+
+
+static int
+ngx_lua_stats(lua_State *L)
+{
+    ngx_lua_threads_t         *threads;
+    ngx_http_lua_main_conf_t  *lmcf;
+
+    lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_lua_module);
+
+    threads = lmcf->lua->threads;
+
+    lua_createtable(L, 0, 6);
+
+    lua_pushinteger(L, threads ? threads->size : 0);
+    lua_setfield(L, -2, "thread_pool_size");
+
+    lua_pushinteger(L, threads ? threads->nfree : 0);
+    lua_setfield(L, -2, "thread_pool_free");
+
+    lua_pushinteger(L, threads ? threads->hits : 0);
+    lua_setfield(L, -2, "thread_pool_hits");
+
+    lua_pushinteger(L, threads ? threads->misses : 0);
+    lua_setfield(L, -2, "thread_pool_misses");
+
+    lua_pushinteger(L, lmcf->bytecode_hits);
+    lua_setfield(L, -2, "bytecode_cache_hits");
+
+    lua_pushinteger(L, lmcf->bytecode_misses);
+    lua_setfield(L, -2, "bytecode_cache_misses");
+
+    return 1;
+}
+
+
+static const struct luaL_Reg  lua_stats_methods[] = {
+    {"stats", ngx_lua_stats},
+    {NULL, NULL},
+};
+
+
+static void
+ngx_lua_stats_register(lua_State *L)
+{
+    luaL_setfuncs(L, lua_stats_methods, 0);
+}
+
+
+int
+ngx_lua_nginx_sleep(lua_State *L)
+{
+    lua_Number  delay;
+    ngx_lua_t   *lua;
+
+    lua = ngx_lua_ext_get(L);
+
+    delay = luaL_checknumber(L, 1);
+
+    if (delay < 0 || delay > NGX_MAX_INT32_VALUE / 1000) {
+        return luaL_error(L, "delay is out of range");
+    }
+
+    if (!lua_isyieldable(L)) {
+        return luaL_error(L, "sleep() is not allowed here");
+    }
+
+    if (ngx_lua_sleep(lua, (ngx_msec_t) (delay * 1000)) != NGX_OK) {
+        return luaL_error(L, "sleep() failed");
+    }
+
+    return ngx_lua_yield(lua);
+}
+
+
+static const struct luaL_Reg  lua_sleep_methods[] = {
+    {"sleep", ngx_lua_nginx_sleep},
+    {NULL, NULL},
+};
+
+
+static void
+ngx_lua_sleep_register(lua_State *L)
+{
+    luaL_setfuncs(L, lua_sleep_methods, 0);
+}
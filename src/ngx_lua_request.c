@@ -6,16 +6,51 @@
 #include <ngx_lua_core.h>
 #include <ngx_lua_http.h>
 
+#define NGX_LUA_REQUEST_URI        1
+#define NGX_LUA_REQUEST_METHOD     2
+#define NGX_LUA_REQUEST_CLIENT_IP  3
+#define NGX_LUA_REQUEST_BODY       4
+#define NGX_LUA_REQUEST_HEADERS    5
+#define NGX_LUA_REQUEST_RESP       6
+#define NGX_LUA_REQUEST_CTX        7
+#define NGX_LUA_REQUEST_ARGS       8
+#define NGX_LUA_REQUEST_POST_ARGS  9
+#define NGX_LUA_REQUEST_NKEYS      9
+
+#define NGX_LUA_REQUEST_MAX_ARGS   100
+
+#define LUA_VAR_INDEX_META  "var_index.meta"
+
+#define NGX_LUA_UNESCAPE_COMPONENT  0
+
+static ngx_uint_t ngx_lua_request_key(ngx_str_t *name);
 static int ngx_lua_request_index(lua_State *L);
-static int ngx_lua_request_uri(lua_State *L);
-static int ngx_lua_request_method(lua_State *L);
-static int ngx_lua_request_client_ip(lua_State *L);
-static int ngx_lua_request_body(lua_State *L);
+static ngx_uint_t ngx_lua_request_cache_get(lua_State *L,
+    ngx_http_lua_ctx_t *ctx, ngx_uint_t key);
+static void ngx_lua_request_cache_set(lua_State *L, ngx_http_lua_ctx_t *ctx,
+    ngx_uint_t key);
+static int ngx_lua_request_newindex(lua_State *L);
+static ngx_uint_t ngx_lua_request_property(lua_State *L,
+    ngx_http_request_t *r, ngx_uint_t key);
+static void ngx_lua_request_set_uri(lua_State *L, ngx_http_request_t *r);
+static ngx_uint_t ngx_lua_request_body(lua_State *L, ngx_http_request_t *r);
+static void ngx_lua_request_ctx(lua_State *L, ngx_http_request_t *r);
 static int ngx_lua_request_arg(lua_State *L);
+static int ngx_lua_request_get_args(lua_State *L);
+static int ngx_lua_request_get_post_args(lua_State *L);
+static void ngx_lua_request_args_copy(lua_State *L);
+static ngx_int_t ngx_lua_request_body_text(ngx_http_request_t *r,
+    ngx_str_t *text);
+static void ngx_lua_request_parse_args(lua_State *L, ngx_http_request_t *r,
+    ngx_str_t *args, lua_Integer max);
+static void ngx_lua_request_unescape(lua_State *L, u_char *buf, u_char *p,
+    u_char *last);
+static void ngx_lua_request_args_set(lua_State *L);
 static int ngx_lua_request_var(lua_State *L);
-static int ngx_lua_request_headers(lua_State *L);
-static int ngx_lua_request_response(lua_State *L);
+static int ngx_lua_request_var_index(lua_State *L);
 static int ngx_lua_request_echo(lua_State *L);
+static int ngx_lua_request_flush(lua_State *L);
+static int ngx_lua_request_read_body_chunk(lua_State *L);
 static int ngx_lua_request_exit(lua_State *L);
 static int ngx_lua_request_match_cidr(lua_State *L);
 
@@ -25,28 +60,10 @@ ngx_lua_request_metatable(lua_State *L)
 {
     luaL_newmetatable(L, "lua_request_metatable");
 
-    lua_pushcfunction(L, ngx_lua_request_uri);
-    lua_setfield(L, -2, "uri");
-
-    lua_pushcfunction(L, ngx_lua_request_method);
-    lua_setfield(L, -2, "method");
-
-    lua_pushcfunction(L, ngx_lua_request_client_ip);
-    lua_setfield(L, -2, "client_ip");
-
-    lua_pushcfunction(L, ngx_lua_request_body);
-    lua_setfield(L, -2, "body");
-
-    lua_pushcfunction(L, ngx_lua_request_headers);
-    lua_setfield(L, -2, "headers");
-
-    lua_pushcfunction(L, ngx_lua_request_response);
-    lua_setfield(L, -2, "resp");
-
     lua_pushcfunction(L, ngx_lua_request_index);
     lua_setfield(L, -2, "__index");
 
-    lua_pushcfunction(L, ngx_lua_request_index);
+    lua_pushcfunction(L, ngx_lua_request_newindex);
     lua_setfield(L, -2, "__newindex");
 
     lua_pop(L, 1);
@@ -82,12 +99,30 @@ ngx_lua_http_request_object(lua_State *L)
     lua_setfield(L, -2, "vars");
     /* } r.vars */
 
+    lua_pushcfunction(L, ngx_lua_request_get_args);
+    lua_setfield(L, -2, "get_args");
+
+    lua_pushcfunction(L, ngx_lua_request_get_post_args);
+    lua_setfield(L, -2, "get_post_args");
+
+    lua_pushcfunction(L, ngx_lua_multipart_open);
+    lua_setfield(L, -2, "get_multipart");
+
     lua_pushcfunction(L, ngx_lua_request_echo);
     lua_setfield(L, -2, "echo");
 
+    lua_pushcfunction(L, ngx_lua_request_flush);
+    lua_setfield(L, -2, "flush");
+
+    lua_pushcfunction(L, ngx_lua_request_read_body_chunk);
+    lua_setfield(L, -2, "read_body_chunk");
+
     lua_pushcfunction(L, ngx_lua_request_exit);
     lua_setfield(L, -2, "exit");
 
+    lua_pushcfunction(L, ngx_lua_nginx_sleep);
+    lua_setfield(L, -2, "sleep");
+
     lua_pushcfunction(L, ngx_lua_request_match_cidr);
     lua_setfield(L, -2, "match_cidr");
 
@@ -108,114 +143,286 @@ ngx_lua_http_request(lua_State *L)
 }
 
 
-static int
-ngx_lua_request_index(lua_State *L)
+static ngx_http_lua_ctx_t *
+ngx_lua_http_ctx(lua_State *L, ngx_http_request_t *r)
 {
-    int        n;
-    ngx_str_t  name;
+    ngx_http_lua_ctx_t  *ctx;
 
-    n = lua_gettop(L);
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
 
-    name.data = (u_char *) luaL_checklstring(L, 2, &name.len);
+    /* only the phase script owns the response, filters and log do not */
 
-    luaL_getmetatable(L, "lua_request_metatable");
+    if (ctx == NULL || ctx->lua != ngx_lua_ext_get(L)) {
+        luaL_error(L, "not allowed here");
+    }
 
-    lua_getfield(L, -1, (const char *) name.data);
+    return ctx;
+}
 
-    if (!lua_isfunction(L, -1)) {
-        lua_pushnil(L);
-        return 1;
-    }
 
-    if (n == 2) {
-        lua_call(L, 0, 1);
-        return 1;
-    }
+static ngx_uint_t
+ngx_lua_request_key(ngx_str_t *name)
+{
+    u_char  *p;
 
-    lua_pushvalue(L, 3);
-    lua_call(L, 1, 0);
+    p = name->data;
+
+    switch (name->len) {
+
+    case 3:
+        if (p[0] == 'u' && ngx_strncmp(p, "uri", 3) == 0) {
+            return NGX_LUA_REQUEST_URI;
+        }
+
+        if (p[0] == 'c' && ngx_strncmp(p, "ctx", 3) == 0) {
+            return NGX_LUA_REQUEST_CTX;
+        }
+
+        break;
+
+    case 4:
+        if (p[0] == 'b' && ngx_strncmp(p, "body", 4) == 0) {
+            return NGX_LUA_REQUEST_BODY;
+        }
+
+        if (p[0] == 'r' && ngx_strncmp(p, "resp", 4) == 0) {
+            return NGX_LUA_REQUEST_RESP;
+        }
+
+        break;
+
+    case 6:
+        if (ngx_strncmp(p, "method", 6) == 0) {
+            return NGX_LUA_REQUEST_METHOD;
+        }
+
+        break;
+
+    case 7:
+        if (ngx_strncmp(p, "headers", 7) == 0) {
+            return NGX_LUA_REQUEST_HEADERS;
+        }
+
+        break;
+
+    case 9:
+        if (ngx_strncmp(p, "client_ip", 9) == 0) {
+            return NGX_LUA_REQUEST_CLIENT_IP;
+        }
+
+        break;
+    }
 
     return 0;
 }
 
 
 static int
-ngx_lua_request_uri(lua_State *L)
+ngx_lua_request_index(lua_State *L)
 {
-    int                 n;
-    ngx_str_t           str, uri;
+    ngx_str_t           name;
+    ngx_uint_t          key;
     ngx_http_request_t  *r;
+    ngx_http_lua_ctx_t  *ctx;
 
     r = ngx_lua_http_request(L);
-    n = lua_gettop(L);
 
-    if (n == 0) {
-        lua_pushlstring(L, (const char *) r->uri.data, r->uri.len);
+    name.data = (u_char *) luaL_checklstring(L, 2, &name.len);
+
+    key = ngx_lua_request_key(&name);
+
+    if (key == 0) {
+        lua_pushnil(L);
         return 1;
     }
 
-    str.data = (u_char *) luaL_checklstring(L, 1, &str.len);
+    if (key == NGX_LUA_REQUEST_CTX) {
+        ngx_lua_request_ctx(L, r);
+        return 1;
+    }
 
-    uri.len = str.len;
-    uri.data = ngx_pstrdup(r->pool, &str);
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
 
-    if (uri.data == NULL) {
-        luaL_error(L, "uri set failed");
-        return 0;
+    /*
+     * the cache is keyed by property number; a cached uri is only
+     * valid while r->uri still points to the string it was made from
+     */
+
+    if (ctx != NULL
+        && (key != NGX_LUA_REQUEST_URI
+            || (ctx->uri.data == r->uri.data && ctx->uri.len == r->uri.len))
+        && ngx_lua_request_cache_get(L, ctx, key))
+    {
+        return 1;
     }
 
-    r->uri = uri;
+    if (!ngx_lua_request_property(L, r, key) || ctx == NULL) {
+        return 1;
+    }
 
-    return 0;
+    ngx_lua_request_cache_set(L, ctx, key);
+
+    if (key == NGX_LUA_REQUEST_URI) {
+        ctx->uri = r->uri;
+    }
+
+    return 1;
 }
 
 
-static int
-ngx_lua_request_method(lua_State *L)
+/* pushes the cached value and returns 1, or returns 0 with no value */
+
+static ngx_uint_t
+ngx_lua_request_cache_get(lua_State *L, ngx_http_lua_ctx_t *ctx,
+    ngx_uint_t key)
 {
-    ngx_http_request_t  *r;
+    if (ctx->cache_ref == 0) {
+        return 0;
+    }
 
-    r = ngx_lua_http_request(L);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->cache_ref);
+
+    if (lua_rawgeti(L, -1, key) == LUA_TNIL) {
+        lua_pop(L, 2);
+        return 0;
+    }
 
-    lua_pushlstring(L, (const char *) r->method_name.data, r->method_name.len);
+    lua_remove(L, -2);
 
     return 1;
 }
 
 
+/* caches the value on the top of the stack, leaving it there */
+
+static void
+ngx_lua_request_cache_set(lua_State *L, ngx_http_lua_ctx_t *ctx,
+    ngx_uint_t key)
+{
+    if (ctx->cache_ref == 0) {
+        lua_createtable(L, NGX_LUA_REQUEST_NKEYS, 0);
+        ctx->cache_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->cache_ref);
+    lua_pushvalue(L, -2);
+    lua_rawseti(L, -2, key);
+    lua_pop(L, 1);
+}
+
+
 static int
-ngx_lua_request_client_ip(lua_State *L)
+ngx_lua_request_newindex(lua_State *L)
 {
-    ngx_connection_t    *c;
+    ngx_str_t           name;
     ngx_http_request_t  *r;
 
     r = ngx_lua_http_request(L);
-    c = r->connection;
 
-    lua_pushlstring(L, (const char *) c->addr_text.data, c->addr_text.len);
+    name.data = (u_char *) luaL_checklstring(L, 2, &name.len);
 
-    return 1;
+    if (ngx_lua_request_key(&name) != NGX_LUA_REQUEST_URI) {
+        return luaL_error(L, "r.%s cannot be assigned", name.data);
+    }
+
+    ngx_lua_request_set_uri(L, r);
+
+    return 0;
 }
 
 
-static int
-ngx_lua_request_body(lua_State *L)
+/* pushes the property, returns whether it may be cached */
+
+static ngx_uint_t
+ngx_lua_request_property(lua_State *L, ngx_http_request_t *r, ngx_uint_t key)
+{
+    ngx_connection_t  *c;
+
+    switch (key) {
+
+    case NGX_LUA_REQUEST_URI:
+        lua_pushlstring(L, (const char *) r->uri.data, r->uri.len);
+        return 1;
+
+    case NGX_LUA_REQUEST_METHOD:
+        lua_pushlstring(L, (const char *) r->method_name.data,
+                        r->method_name.len);
+        return 1;
+
+    case NGX_LUA_REQUEST_CLIENT_IP:
+        c = r->connection;
+        lua_pushlstring(L, (const char *) c->addr_text.data,
+                        c->addr_text.len);
+        return 1;
+
+    case NGX_LUA_REQUEST_BODY:
+        return ngx_lua_request_body(L, r);
+
+    case NGX_LUA_REQUEST_HEADERS:
+        ngx_lua_headers_push(L, r, 0);
+        return 1;
+
+    case NGX_LUA_REQUEST_RESP:
+        ngx_lua_response_push(L, r);
+        return 1;
+
+    default:
+        lua_pushnil(L);
+        return 0;
+    }
+}
+
+
+static void
+ngx_lua_request_set_uri(lua_State *L, ngx_http_request_t *r)
+{
+    ngx_str_t  str, uri;
+
+    str.data = (u_char *) luaL_checklstring(L, 3, &str.len);
+
+    uri.len = str.len;
+    uri.data = ngx_pstrdup(r->pool, &str);
+
+    if (uri.data == NULL) {
+        luaL_error(L, "uri set failed");
+        return;
+    }
+
+    r->uri = uri;
+}
+
+
+static ngx_uint_t
+ngx_lua_request_body(lua_State *L, ngx_http_request_t *r)
 {
     ngx_buf_t           *buf;
     ngx_chain_t         *cl;
     luaL_Buffer         b;
-    ngx_http_request_t  *r;
+    ngx_http_lua_ctx_t  *ctx;
 
-    r = ngx_lua_http_request(L);
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
 
-    if (r->request_body == NULL
-        || r->request_body->bufs == NULL
-        || r->request_body->temp_file)
+    /* a streamed body is only seen through r.read_body_chunk() */
+
+    if (r->request_body == NULL || r->reading_body
+        || (ctx != NULL && ctx->stream))
     {
         lua_pushnil(L);
+        return 0;
+    }
+
+    /* a body spilled to a temp file is mapped instead of copied */
+
+    if (r->request_body->temp_file) {
+        ngx_lua_body_view(L, r);
         return 1;
     }
 
+    if (r->request_body->bufs == NULL) {
+        lua_pushnil(L);
+        return 0;
+    }
+
     luaL_buffinit(L, &b);
 
     cl = r->request_body->bufs;
@@ -232,6 +439,30 @@ ngx_lua_request_body(lua_State *L)
 }
 
 
+static void
+ngx_lua_request_ctx(lua_State *L, ngx_http_request_t *r)
+{
+    ngx_lua_t           *lua;
+    ngx_http_lua_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
+    if (ctx == NULL) {
+        luaL_error(L, "not allowed here");
+        return;
+    }
+
+    /* taken from the recycled tables on first use only */
+
+    if (ctx->ctx_ref == 0) {
+        lua = ngx_lua_ext_get(L);
+        ctx->ctx_ref = ngx_lua_table_get(L, lua->tables);
+    }
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->ctx_ref);
+}
+
+
 static int
 ngx_lua_request_arg(lua_State *L)
 {
@@ -258,53 +489,448 @@ ngx_lua_request_arg(lua_State *L)
 }
 
 
+static int
+ngx_lua_request_get_args(lua_State *L)
+{
+    lua_Integer         max;
+    ngx_http_request_t  *r;
+    ngx_http_lua_ctx_t  *ctx;
+
+    max = luaL_optinteger(L, 1, NGX_LUA_REQUEST_MAX_ARGS);
+
+    r = ngx_lua_http_request(L);
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
+    /* parsed once per request, again only if r->args was replaced */
+
+    if (ctx != NULL
+        && ctx->args.data == r->args.data && ctx->args.len == r->args.len
+        && ctx->args_max == max
+        && ngx_lua_request_cache_get(L, ctx, NGX_LUA_REQUEST_ARGS))
+    {
+        ngx_lua_request_args_copy(L);
+        return 1;
+    }
+
+    ngx_lua_request_parse_args(L, r, &r->args, max);
+
+    if (ctx != NULL) {
+        ngx_lua_request_cache_set(L, ctx, NGX_LUA_REQUEST_ARGS);
+        ctx->args = r->args;
+        ctx->args_max = max;
+
+        ngx_lua_request_args_copy(L);
+    }
+
+    return 1;
+}
+
+
+static int
+ngx_lua_request_get_post_args(lua_State *L)
+{
+    ngx_str_t           body;
+    lua_Integer         max;
+    ngx_table_elt_t     *type;
+    ngx_http_request_t  *r;
+    ngx_http_lua_ctx_t  *ctx;
+
+    max = luaL_optinteger(L, 1, NGX_LUA_REQUEST_MAX_ARGS);
+
+    r = ngx_lua_http_request(L);
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
+    if (ctx != NULL && ctx->stream) {
+        return luaL_error(L, "request body is streamed");
+    }
+
+    if (r->request_body == NULL || r->reading_body) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "request body is not read");
+        return 2;
+    }
+
+    type = r->headers_in.content_type;
+
+    if (type == NULL
+        || type->value.len < sizeof("application/x-www-form-urlencoded") - 1
+        || ngx_strncasecmp(type->value.data,
+                           (u_char *) "application/x-www-form-urlencoded",
+                           sizeof("application/x-www-form-urlencoded") - 1)
+           != 0)
+    {
+        lua_pushnil(L);
+        lua_pushliteral(L, "request body is not a form");
+        return 2;
+    }
+
+    /* the body does not change once read */
+
+    if (ctx != NULL
+        && ctx->post_args_max == max
+        && ngx_lua_request_cache_get(L, ctx, NGX_LUA_REQUEST_POST_ARGS))
+    {
+        ngx_lua_request_args_copy(L);
+        return 1;
+    }
+
+    if (ngx_lua_request_body_text(r, &body) != NGX_OK) {
+        return luaL_error(L, "post args failed");
+    }
+
+    ngx_lua_request_parse_args(L, r, &body, max);
+
+    if (ctx != NULL) {
+        ngx_lua_request_cache_set(L, ctx, NGX_LUA_REQUEST_POST_ARGS);
+        ctx->post_args_max = max;
+
+        ngx_lua_request_args_copy(L);
+    }
+
+    return 1;
+}
+
+
+/*
+ * The parsed table stays in the cache, the caller gets a copy of it
+ * and of the value arrays of repeated names, free to change.
+ */
+
+static void
+ngx_lua_request_args_copy(lua_State *L)
+{
+    int          n;
+    lua_Integer  i, len;
+
+    n = 0;
+
+    lua_pushnil(L);
+
+    while (lua_next(L, -2)) {
+        lua_pop(L, 1);
+        n++;
+    }
+
+    lua_createtable(L, 0, n);
+
+    lua_pushnil(L);
+
+    while (lua_next(L, -3)) {
+        if (lua_type(L, -1) == LUA_TTABLE) {
+            len = lua_rawlen(L, -1);
+
+            lua_createtable(L, len, 0);
+
+            for (i = 1; i <= len; i++) {
+                lua_rawgeti(L, -2, i);
+                lua_rawseti(L, -2, i);
+            }
+
+            lua_remove(L, -2);
+        }
+
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, -4);
+    }
+
+    lua_remove(L, -2);
+}
+
+
+/* the read body as one piece of memory, copied only if it is not already */
+
+static ngx_int_t
+ngx_lua_request_body_text(ngx_http_request_t *r, ngx_str_t *text)
+{
+    u_char                   *p;
+    size_t                   len;
+    ssize_t                  n;
+    ngx_buf_t                *buf;
+    ngx_file_t               *file;
+    ngx_chain_t              *cl;
+    ngx_http_request_body_t  *rb;
+
+    rb = r->request_body;
+
+    if (rb->temp_file) {
+        file = &rb->temp_file->file;
+        len = (size_t) file->offset;
+
+        p = ngx_pnalloc(r->pool, len);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        n = ngx_read_file(file, p, len, 0);
+
+        if (n != (ssize_t) len) {
+            return NGX_ERROR;
+        }
+
+        text->data = p;
+        text->len = len;
+
+        return NGX_OK;
+    }
+
+    if (rb->bufs == NULL) {
+        ngx_str_null(text);
+        return NGX_OK;
+    }
+
+    if (rb->bufs->next == NULL) {
+        buf = rb->bufs->buf;
+        text->data = buf->pos;
+        text->len = buf->last - buf->pos;
+        return NGX_OK;
+    }
+
+    len = 0;
+
+    for (cl = rb->bufs; cl; cl = cl->next) {
+        len += cl->buf->last - cl->buf->pos;
+    }
+
+    p = ngx_pnalloc(r->pool, len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    text->data = p;
+    text->len = len;
+
+    for (cl = rb->bufs; cl; cl = cl->next) {
+        p = ngx_cpymem(p, cl->buf->pos, cl->buf->last - cl->buf->pos);
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * Pushes a table of the unescaped "key=value" pairs of args, at most
+ * max of them unless max is 0.  A key without "=" is true, a repeated
+ * key gets an array of its values.
+ */
+
+static void
+ngx_lua_request_parse_args(lua_State *L, ngx_http_request_t *r,
+    ngx_str_t *args, lua_Integer max)
+{
+    u_char       *p, *last, *end, *eq, *buf;
+    ngx_uint_t   n;
+    lua_Integer  count;
+
+    n = 1;
+
+    for (p = args->data, last = p + args->len; p < last; p++) {
+        if (*p == '&') {
+            n++;
+        }
+    }
+
+    if (max > 0 && (lua_Integer) n > max) {
+        n = (ngx_uint_t) max;
+    }
+
+    lua_createtable(L, 0, args->len ? n : 0);
+
+    if (args->len == 0) {
+        return;
+    }
+
+    buf = ngx_pnalloc(r->pool, args->len);
+    if (buf == NULL) {
+        luaL_error(L, "args failed");
+        return;
+    }
+
+    count = 0;
+
+    for (p = args->data, last = p + args->len; p < last; p = end + 1) {
+
+        end = ngx_strlchr(p, last, '&');
+        if (end == NULL) {
+            end = last;
+        }
+
+        eq = ngx_strlchr(p, end, '=');
+
+        if (eq == p || p == end) {
+            continue;
+        }
+
+        if (max > 0 && count++ == max) {
+            break;
+        }
+
+        /* the key */
+
+        ngx_lua_request_unescape(L, buf, p, eq ? eq : end);
+
+        /* the value */
+
+        if (eq == NULL) {
+            lua_pushboolean(L, 1);
+
+        } else {
+            ngx_lua_request_unescape(L, buf, eq + 1, end);
+        }
+
+        ngx_lua_request_args_set(L);
+    }
+}
+
+
+/* pushes the unescaped form of [p, last), buf is scratch space for it */
+
+static void
+ngx_lua_request_unescape(lua_State *L, u_char *buf, u_char *p, u_char *last)
+{
+    u_char  *dst, *src;
+
+    for (dst = buf; p < last; p++) {
+        *dst++ = (*p == '+') ? ' ' : *p;
+    }
+
+    src = buf;
+    last = dst;
+    dst = buf;
+
+    ngx_unescape_uri(&dst, &src, last - buf, NGX_LUA_UNESCAPE_COMPONENT);
+
+    lua_pushlstring(L, (const char *) buf, dst - buf);
+}
+
+
+/* sets t[key] = value for t, key, value on the stack, pops key and value */
+
+static void
+ngx_lua_request_args_set(lua_State *L)
+{
+    lua_pushvalue(L, -2);
+
+    switch (lua_rawget(L, -4)) {
+
+    case LUA_TNIL:
+        lua_pop(L, 1);
+        lua_rawset(L, -3);
+        break;
+
+    case LUA_TTABLE:
+        lua_insert(L, -2);
+        lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+        lua_pop(L, 2);
+        break;
+
+    default:
+        lua_createtable(L, 2, 0);
+        lua_insert(L, -2);
+        lua_rawseti(L, -2, 1);
+        lua_insert(L, -2);
+        lua_rawseti(L, -2, 2);
+        lua_rawset(L, -3);
+        break;
+    }
+}
+
+
 static int
 ngx_lua_request_var(lua_State *L)
 {
     int                        n;
+    u_char                     *lowcase;
     ngx_str_t                  name, value;
-    ngx_uint_t                 key;
+    ngx_uint_t                 key, *index;
     ngx_http_request_t         *r;
-    ngx_http_variable_t        *v;
+    ngx_http_variable_t        *v, *hv;
     ngx_http_variable_value_t  *vv;
     ngx_http_core_main_conf_t  *cmcf;
 
     r = ngx_lua_http_request(L);
     n = lua_gettop(L);
 
-    name.data = (u_char *) luaL_checklstring(L, 2, &name.len);
-    key = ngx_hash_strlow(name.data, name.data, name.len);
+    cmcf = ngx_http_get_module_main_conf(r, ngx_http_core_module);
 
-    if (n == 2) {
-        vv = ngx_http_get_variable(r, &name, key);
-        if (vv == NULL || vv->not_found) {
-            return 0;
+    /* a handle from ngx.var_index() goes straight to the variable */
+
+    index = luaL_testudata(L, 2, LUA_VAR_INDEX_META);
+
+    if (index != NULL) {
+        if (*index >= cmcf->variables.nelts) {
+            return luaL_error(L, "invalid variable index");
         }
 
-        lua_pushlstring(L, (const char *) vv->data, vv->len);
-        return 1;
+        if (n == 2) {
+            vv = ngx_http_get_flushed_variable(r, *index);
+            goto value;
+        }
+
+        v = cmcf->variables.elts;
+        v = &v[*index];
+
+        /*
+         * The indexed copy has no set handler, writes go through
+         * the variable itself, found by the lowercase name it keeps.
+         */
+
+        key = ngx_hash_key(v->name.data, v->name.len);
+
+        hv = ngx_hash_find(&cmcf->variables_hash, key, v->name.data,
+                           v->name.len);
+        if (hv != NULL) {
+            v = hv;
+        }
+
+        goto set;
     }
 
-    value.data = (u_char *) luaL_checklstring(L, 3, &value.len);
+    name.data = (u_char *) luaL_checklstring(L, 2, &name.len);
 
-    cmcf = ngx_http_get_module_main_conf(r, ngx_http_core_module);
+    /* the name is a Lua string, it is lowercased into a copy */
+
+    lowcase = ngx_pnalloc(r->pool, name.len);
+    if (lowcase == NULL) {
+        return luaL_error(L, "variable failed");
+    }
+
+    key = ngx_hash_strlow(lowcase, name.data, name.len);
+    name.data = lowcase;
+
+    if (n == 2) {
+        vv = ngx_http_get_variable(r, &name, key);
+        goto value;
+    }
 
     v = ngx_hash_find(&cmcf->variables_hash, key, name.data, name.len);
     if (v == NULL) {
-        luaL_error(L, "variable not found");
-        return 0;
+        return luaL_error(L, "variable not found");
     }
 
+set:
+
+    value.data = (u_char *) luaL_checklstring(L, 3, &value.len);
+
     if (v->set_handler != NULL) {
         vv = ngx_pcalloc(r->pool, sizeof(ngx_http_variable_value_t));
         if (vv == NULL) {
             goto fail;
         }
 
+        /* setters keep the pointer, the Lua string may be collected */
+
+        vv->data = ngx_pnalloc(r->pool, value.len);
+        if (vv->data == NULL) {
+            goto fail;
+        }
+
         vv->valid = 1;
         vv->not_found = 0;
-        vv->data = value.data;
         vv->len = value.len;
+        ngx_memcpy(vv->data, value.data, value.len);
 
         v->set_handler(r, vv, v->data);
 
@@ -312,8 +938,7 @@ ngx_lua_request_var(lua_State *L)
     }
 
     if (!(v->flags & NGX_HTTP_VAR_INDEXED)) {
-        luaL_error(L, "variable is not writable");
-        return 0;
+        return luaL_error(L, "variable is not writable");
     }
 
     vv = &r->variables[v->index];
@@ -331,39 +956,67 @@ ngx_lua_request_var(lua_State *L)
 
     return 0;
 
-fail:
+value:
+
+    if (vv == NULL || vv->not_found) {
+        return 0;
+    }
 
-    luaL_error(L, "variable set failed");
+    lua_pushlstring(L, (const char *) vv->data, vv->len);
 
-    return 0;
+    return 1;
+
+fail:
+
+    return luaL_error(L, "variable set failed");
 }
 
 
-static int
-ngx_lua_request_headers(lua_State *L)
+/*
+ * ngx.var_index(name) hands out a handle of a variable indexed at
+ * configuration, by lua_var_index or by any other directive using it.
+ * The handle is a userdata, so numeric keys of r.vars stay names ($1).
+ */
+
+void
+ngx_lua_request_var_index_register(lua_State *L, ngx_array_t *variables)
 {
-    ngx_http_request_t  *r;
+    ngx_uint_t           i, *index;
+    ngx_http_variable_t  *v;
 
-    r = ngx_lua_http_request(L);
+    luaL_newmetatable(L, LUA_VAR_INDEX_META);
+    lua_pop(L, 1);
 
-    lua_pushlightuserdata(L, &r->headers_in.headers);
+    lua_getglobal(L, "ngx");
 
-    luaL_setmetatable(L, "lua_headers_metatable");
+    v = variables->elts;
 
-    return 1;
+    lua_createtable(L, 0, variables->nelts);
+
+    for (i = 0; i < variables->nelts; i++) {
+        lua_pushlstring(L, (const char *) v[i].name.data, v[i].name.len);
+
+        index = lua_newuserdatauv(L, sizeof(ngx_uint_t), 0);
+        *index = i;
+        luaL_setmetatable(L, LUA_VAR_INDEX_META);
+
+        lua_rawset(L, -3);
+    }
+
+    lua_pushcclosure(L, ngx_lua_request_var_index, 1);
+    lua_setfield(L, -2, "var_index");
+
+    lua_pop(L, 1);
 }
 
 
 static int
-ngx_lua_request_response(lua_State *L)
+ngx_lua_request_var_index(lua_State *L)
 {
-    ngx_http_request_t  *r;
+    luaL_checkstring(L, 1);
 
-    r = ngx_lua_http_request(L);
-
-    lua_pushlightuserdata(L, r);
-
-    luaL_setmetatable(L, "lua_response_metatable");
+    lua_settop(L, 1);
+    lua_rawget(L, lua_upvalueindex(1));
 
     return 1;
 }
@@ -374,27 +1027,291 @@ ngx_lua_request_echo(lua_State *L)
 {
     ngx_buf_t           *b;
     ngx_str_t           str;
+    ngx_chain_t         *cl;
     ngx_http_request_t  *r;
     ngx_http_lua_ctx_t  *ctx;
 
     r = ngx_lua_http_request(L);
-    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    ctx = ngx_lua_http_ctx(L, r);
 
     str.data = (u_char *) luaL_checklstring(L, 1, &str.len);
 
-    b = ngx_create_temp_buf(r->pool, str.len);
-    if (b == NULL) {
+    if (str.len == 0) {
+        return 0;
+    }
+
+    /*
+     * the buffer references the string memory directly,
+     * the string is kept alive until the buffer is sent
+     */
+
+    if (ctx->pins_ref == 0) {
+        lua_newtable(L);
+        ctx->pins_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->pins_ref);
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, ++ctx->npins);
+    lua_pop(L, 1);
+
+    cl = ngx_chain_get_free_buf(r->pool, &ctx->free);
+    if (cl == NULL) {
         return luaL_error(L, "echo() failed");
     }
 
-    b->last = ngx_cpymem(b->last, str.data, str.len);
+    b = cl->buf;
+    ngx_memzero(b, sizeof(ngx_buf_t));
+
+    b->tag = (ngx_buf_tag_t) &ngx_http_lua_module;
+    b->memory = 1;
+    b->start = str.data;
+    b->pos = str.data;
+    b->last = str.data + str.len;
+    b->end = b->last;
 
-    ctx->buf = b;
+    *ctx->last_out = cl;
+    ctx->last_out = &cl->next;
 
     return 0;
 }
 
 
+static int
+ngx_lua_request_flush(lua_State *L)
+{
+    ngx_int_t                 rc;
+    ngx_event_t               *wev;
+    ngx_http_request_t        *r;
+    ngx_http_lua_ctx_t        *ctx;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    r = ngx_lua_http_request(L);
+    ctx = ngx_lua_http_ctx(L, r);
+
+    if (!r->header_sent) {
+        rc = ngx_lua_response_send_header(r, ctx, 0);
+        if (rc == NGX_ERROR || rc > NGX_OK) {
+            return luaL_error(L, "flush() failed");
+        }
+    }
+
+    rc = ngx_lua_response_output(L, r, ctx, NGX_HTTP_FLUSH);
+    if (rc == NGX_ERROR) {
+        return luaL_error(L, "flush() failed");
+    }
+
+    if (!r->buffered && !r->connection->buffered) {
+        return 0;
+    }
+
+    /* wait until the client has taken the data */
+
+    wev = r->connection->write;
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (!wev->delayed) {
+        ngx_add_timer(wev, clcf->send_timeout);
+    }
+
+    if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+        return luaL_error(L, "flush() failed");
+    }
+
+    r->write_event_handler = ngx_lua_response_flush_handler;
+
+    return ngx_lua_yield(ctx->lua);
+}
+
+
+static void
+ngx_lua_request_body_post(ngx_http_request_t *r)
+{
+    /* the body is taken by read_body_chunk() as it arrives */
+}
+
+
+static ngx_int_t
+ngx_lua_request_read_chunk(lua_State *L, ngx_http_request_t *r,
+    ngx_http_lua_ctx_t *ctx)
+{
+    size_t                    size, n;
+    ngx_int_t                 rc;
+    ngx_buf_t                 *buf;
+    luaL_Buffer               b;
+    ngx_chain_t               *cl;
+    ngx_http_request_body_t   *rb;
+
+    rb = r->request_body;
+
+    for ( ;; ) {
+
+        while (rb->bufs != NULL && ngx_buf_size(rb->bufs->buf) == 0) {
+            rb->bufs = rb->bufs->next;
+        }
+
+        if (rb->bufs != NULL) {
+            luaL_buffinit(L, &b);
+
+            size = ctx->body_chunk;
+
+            for (cl = rb->bufs; cl && size; cl = cl->next) {
+                buf = cl->buf;
+
+                if (!ngx_buf_in_memory(buf)) {
+                    buf->file_pos = buf->file_last;
+                    continue;
+                }
+
+                n = ngx_min(size, (size_t) (buf->last - buf->pos));
+
+                luaL_addlstring(&b, (char *) buf->pos, n);
+
+                buf->pos += n;
+                size -= n;
+            }
+
+            /* consumed buffers are released to the body reader */
+
+            while (rb->bufs != NULL && ngx_buf_size(rb->bufs->buf) == 0) {
+                rb->bufs = rb->bufs->next;
+            }
+
+            luaL_pushresult(&b);
+
+            if (size < ctx->body_chunk) {
+                return NGX_OK;
+            }
+
+            lua_pop(L, 1);
+        }
+
+        if (!r->reading_body) {
+            lua_pushnil(L);
+            return NGX_OK;
+        }
+
+        rc = ngx_http_read_unbuffered_request_body(r);
+
+        if (rc == NGX_ERROR || rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+            lua_pushnil(L);
+            lua_pushstring(L, (rc == NGX_HTTP_REQUEST_TIME_OUT) ? "timeout"
+                                                               : "read failed");
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_AGAIN && rb->bufs == NULL) {
+            return NGX_AGAIN;
+        }
+    }
+}
+
+
+static void
+ngx_lua_request_read_body_handler(ngx_http_request_t *r)
+{
+    ngx_int_t           rc;
+    ngx_http_lua_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
+    rc = ngx_lua_request_read_chunk(ctx->lua->state, r, ctx);
+
+    if (rc == NGX_AGAIN) {
+        return;
+    }
+
+    r->read_event_handler = ngx_http_block_reading;
+
+    ngx_lua_wake(ctx->lua, (rc == NGX_OK) ? 1 : 2);
+}
+
+
+static int
+ngx_lua_request_read_body_chunk(lua_State *L)
+{
+    ngx_int_t           rc;
+    lua_Integer         size;
+    ngx_http_request_t  *r;
+    ngx_http_lua_ctx_t  *ctx;
+
+    r = ngx_lua_http_request(L);
+    ctx = ngx_lua_http_ctx(L, r);
+
+    size = luaL_optinteger(L, 1, 8192);
+
+    if (size <= 0) {
+        return luaL_error(L, "size is out of range");
+    }
+
+    rc = ngx_lua_request_body_chunk(L, r, ctx, size);
+
+    if (rc == NGX_OK) {
+        return 1;
+    }
+
+    if (rc == NGX_ERROR) {
+        return 2;
+    }
+
+    return ngx_lua_yield(ctx->lua);
+}
+
+
+/*
+ * Pushes the next chunk of a streamed body, or nil at its end, and
+ * returns NGX_OK; pushes nil and an error and returns NGX_ERROR; or
+ * returns NGX_AGAIN, and the script is to yield until it is woken with
+ * what would have been pushed.
+ */
+
+ngx_int_t
+ngx_lua_request_body_chunk(lua_State *L, ngx_http_request_t *r,
+    ngx_http_lua_ctx_t *ctx, size_t size)
+{
+    ngx_int_t  rc;
+
+    if (!ctx->stream) {
+        luaL_error(L, "request body is not streamed");
+        return NGX_ERROR;
+    }
+
+    ctx->body_chunk = size;
+
+    if (r->request_body == NULL) {
+        r->request_body_no_buffering = 1;
+
+        rc = ngx_http_read_client_request_body(r, ngx_lua_request_body_post);
+
+        if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+            lua_pushnil(L);
+            lua_pushstring(L, "read failed");
+            return NGX_ERROR;
+        }
+
+        /* drop the reference taken by the body reader */
+
+        ngx_http_finalize_request(r, NGX_DONE);
+
+        /* a body already discarded is not read again */
+
+        if (r->request_body == NULL) {
+            lua_pushnil(L);
+            lua_pushliteral(L, "request body is discarded");
+            return NGX_ERROR;
+        }
+    }
+
+    rc = ngx_lua_request_read_chunk(L, r, ctx);
+
+    if (rc == NGX_AGAIN) {
+        r->read_event_handler = ngx_lua_request_read_body_handler;
+    }
+
+    return rc;
+}
+
+
 static int
 ngx_lua_request_exit(lua_State *L)
 {
@@ -403,7 +1320,7 @@ ngx_lua_request_exit(lua_State *L)
     ngx_http_request_t  *r;
 
     r = ngx_lua_http_request(L);
-    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    ctx = ngx_lua_http_ctx(L, r);
 
     status = luaL_checkinteger(L, 1);
 
@@ -412,6 +1329,7 @@ ngx_lua_request_exit(lua_State *L)
     }
 
     ctx->status = status;
+    ctx->exited = 1;
 
     lua_yield(L, 0);
 
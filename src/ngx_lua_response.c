@@ -27,15 +27,29 @@ ngx_lua_response_metatable(lua_State *L)
 }
 
 
+void
+ngx_lua_response_push(lua_State *L, ngx_http_request_t *r)
+{
+    ngx_http_request_t  **rp;
+
+    /* the uservalue keeps resp.headers once made */
+
+    rp = lua_newuserdatauv(L, sizeof(ngx_http_request_t *), 1);
+    *rp = r;
+
+    luaL_setmetatable(L, "lua_response_metatable");
+}
+
+
 static int
 ngx_lua_response_index(lua_State *L)
 {
-    int                 n;
-    ngx_str_t           name;
-    ngx_http_request_t  *r;
+    int        n;
+    ngx_str_t  name;
 
     n = lua_gettop(L);
-    r = lua_touserdata(L, 1);
+
+    luaL_checkudata(L, 1, "lua_response_metatable");
     name.data = (u_char *) luaL_checklstring(L, 2, &name.len);
 
     luaL_getmetatable(L, "lua_response_metatable");
@@ -45,7 +59,7 @@ ngx_lua_response_index(lua_State *L)
         return 0;
     }
 
-    lua_pushlightuserdata(L, r);
+    lua_pushvalue(L, 1);
 
     if (n == 2) {
         lua_call(L, 1, 1);
@@ -62,13 +76,172 @@ ngx_lua_response_index(lua_State *L)
 static int
 ngx_lua_response_headers(lua_State *L)
 {
-    ngx_http_request_t  *r;
+    ngx_http_request_t  **rp;
 
-    r = lua_touserdata(L, 1);
+    rp = lua_touserdata(L, 1);
 
-    lua_pushlightuserdata(L, &r->headers_out.headers);
-
-    luaL_setmetatable(L, "lua_headers_metatable");
+    if (lua_getiuservalue(L, 1, 1) == LUA_TNIL) {
+        ngx_lua_headers_push(L, *rp, 1);
+        lua_pushvalue(L, -1);
+        lua_setiuservalue(L, 1, 1);
+    }
 
     return 1;
 }
+
+
+ngx_int_t
+ngx_lua_response_send_header(ngx_http_request_t *r, ngx_http_lua_ctx_t *ctx,
+    ngx_uint_t last)
+{
+    off_t        len;
+    ngx_chain_t  *cl;
+
+    /* a streamed body may still be read after r.flush() */
+
+    if (!ctx->stream && ngx_http_discard_request_body(r) != NGX_OK) {
+        r->keepalive = 0;
+    }
+
+    r->headers_out.status = (ctx->status > 0) ? ctx->status : NGX_HTTP_OK;
+
+    if (ngx_http_set_content_type(r) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (last) {
+        len = 0;
+
+        for (cl = ctx->out; cl; cl = cl->next) {
+            len += ngx_buf_size(cl->buf);
+        }
+
+        /* the length of what was echoed wins over a script header */
+
+        ngx_http_clear_content_length(r);
+        r->headers_out.content_length_n = len;
+
+    } else {
+        ngx_http_clear_content_length(r);
+    }
+
+    return ngx_http_send_header(r);
+}
+
+
+ngx_int_t
+ngx_lua_response_output(lua_State *L, ngx_http_request_t *r,
+    ngx_http_lua_ctx_t *ctx, ngx_uint_t flags)
+{
+    ngx_int_t     rc;
+    ngx_buf_t     *b;
+    ngx_chain_t   *cl, *out;
+
+    if (r->header_only) {
+        ctx->out = NULL;
+        ctx->last_out = &ctx->out;
+        return NGX_OK;
+    }
+
+    if (flags) {
+        cl = ngx_chain_get_free_buf(r->pool, &ctx->free);
+        if (cl == NULL) {
+            return NGX_ERROR;
+        }
+
+        b = cl->buf;
+        ngx_memzero(b, sizeof(ngx_buf_t));
+
+        b->tag = (ngx_buf_tag_t) &ngx_http_lua_module;
+
+        if (flags & NGX_HTTP_LAST) {
+            b->last_buf = (r == r->main) ? 1 : 0;
+            b->last_in_chain = 1;
+            b->sync = b->last_buf ? 0 : 1;
+
+        } else {
+            b->flush = 1;
+        }
+
+        *ctx->last_out = cl;
+        ctx->last_out = &cl->next;
+    }
+
+    out = ctx->out;
+
+    ctx->out = NULL;
+    ctx->last_out = &ctx->out;
+
+    if (out == NULL && !r->buffered && !r->connection->buffered) {
+        return NGX_OK;
+    }
+
+    rc = ngx_http_output_filter(r, out);
+
+    ngx_chain_update_chains(r->pool, &ctx->free, &ctx->busy, &out,
+                            (ngx_buf_tag_t) &ngx_http_lua_module);
+
+    /* strings referenced by the sent buffers may be collected now */
+
+    if (ctx->busy == NULL && ctx->pins_ref != 0) {
+        luaL_unref(L, LUA_REGISTRYINDEX, ctx->pins_ref);
+        ctx->pins_ref = 0;
+        ctx->npins = 0;
+    }
+
+    return rc;
+}
+
+
+void
+ngx_lua_response_flush_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                 rc;
+    ngx_event_t               *wev;
+    ngx_connection_t          *c;
+    ngx_http_lua_ctx_t        *ctx;
+    ngx_http_core_loc_conf_t  *clcf;
+    ngx_http_lua_main_conf_t  *lmcf;
+
+    c = r->connection;
+    wev = c->write;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http lua flush handler");
+
+    if (wev->timedout) {
+        c->timedout = 1;
+        ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
+    rc = ngx_lua_response_output(lmcf->lua->state, r, ctx, 0);
+    if (rc == NGX_ERROR) {
+        ngx_http_finalize_request(r, NGX_ERROR);
+        return;
+    }
+
+    if (r->buffered || c->buffered) {
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+        if (!wev->delayed) {
+            ngx_add_timer(wev, clcf->send_timeout);
+        }
+
+        if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_ERROR);
+        }
+
+        return;
+    }
+
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    ngx_lua_wake(ctx->lua, 0);
+}
@@ -0,0 +1,1132 @@
+
+/*
+ * Copyright (C) Zhidao HONG
+ */
+
+#include <ngx_event_connect.h>
+#include <ngx_lua_core.h>
+
+#define LUA_SOCKET_META  "socket.meta"
+
+#define NGX_LUA_SOCKET_BUFFER_SIZE  4096
+#define NGX_LUA_SOCKET_TIMEOUT      60000
+#define NGX_LUA_SOCKET_POOL_SIZE    30
+
+#define NGX_LUA_SOCKET_LINE  0
+#define NGX_LUA_SOCKET_SIZE  1
+#define NGX_LUA_SOCKET_ALL   2
+
+typedef struct ngx_lua_socket_s  ngx_lua_socket_t;
+
+typedef void (*ngx_lua_socket_handler_pt)(ngx_lua_socket_t *s,
+    ngx_event_t *ev);
+
+struct ngx_lua_socket_s {
+    ngx_peer_connection_t      peer;
+    ngx_lua_t                  *lua;
+    ngx_pool_cleanup_t         *cleanup;
+    ngx_lua_socket_handler_pt  handler;
+    ngx_msec_t                 timeout;
+    ngx_buf_t                  buffer;
+    ngx_str_t                  send;
+    size_t                     size;
+    ngx_uint_t                 pattern;
+    unsigned                   eof:1;
+};
+
+typedef struct {
+    ngx_queue_t                queue;
+    ngx_str_t                  name;
+    ngx_queue_t                cache;
+    ngx_queue_t                free;
+    ngx_queue_t                spare;   /* items left over by shrinking */
+    ngx_uint_t                 size;
+} ngx_lua_socket_pool_t;
+
+typedef struct {
+    ngx_queue_t                queue;
+    ngx_connection_t           *connection;
+    ngx_lua_socket_pool_t      *pool;
+} ngx_lua_socket_item_t;
+
+static int ngx_lua_socket_tcp(lua_State *L);
+static int ngx_lua_socket_connect(lua_State *L);
+static int ngx_lua_socket_send(lua_State *L);
+static int ngx_lua_socket_receive(lua_State *L);
+static int ngx_lua_socket_settimeout(lua_State *L);
+static int ngx_lua_socket_setkeepalive(lua_State *L);
+static int ngx_lua_socket_close_method(lua_State *L);
+static int ngx_lua_socket_free(lua_State *L);
+static void ngx_lua_socket_event_handler(ngx_event_t *ev);
+static void ngx_lua_socket_connect_handler(ngx_lua_socket_t *s,
+    ngx_event_t *ev);
+static void ngx_lua_socket_send_handler(ngx_lua_socket_t *s,
+    ngx_event_t *ev);
+static void ngx_lua_socket_read_handler(ngx_lua_socket_t *s,
+    ngx_event_t *ev);
+static ngx_int_t ngx_lua_socket_write(ngx_lua_socket_t *s);
+static ngx_int_t ngx_lua_socket_read(ngx_lua_socket_t *s, lua_State *L);
+static void ngx_lua_socket_wake(ngx_lua_socket_t *s, int nresults);
+static void ngx_lua_socket_close(ngx_lua_socket_t *s);
+static void ngx_lua_socket_cleanup(void *data);
+static ngx_lua_socket_pool_t *ngx_lua_socket_pool(ngx_str_t *name,
+    ngx_uint_t size);
+static ngx_int_t ngx_lua_socket_pool_resize(ngx_lua_socket_pool_t *pool,
+    ngx_uint_t size);
+static ngx_int_t ngx_lua_socket_keepalive_get(ngx_lua_socket_t *s);
+static void ngx_lua_socket_keepalive_handler(ngx_event_t *ev);
+
+static ngx_queue_t  ngx_lua_socket_pools;
+
+static const struct luaL_Reg  ngx_lua_socket_methods[] = {
+    {"connect", ngx_lua_socket_connect},
+    {"send", ngx_lua_socket_send},
+    {"receive", ngx_lua_socket_receive},
+    {"settimeout", ngx_lua_socket_settimeout},
+    {"setkeepalive", ngx_lua_socket_setkeepalive},
+    {"close", ngx_lua_socket_close_method},
+    {NULL, NULL},
+};
+
+
+void
+ngx_lua_socket_register(lua_State *L)
+{
+    /* ngx.socket = { tcp = tcp } */
+    lua_newtable(L);
+
+    lua_pushcfunction(L, ngx_lua_socket_tcp);
+    lua_setfield(L, -2, "tcp");
+
+    lua_setfield(L, -2, "socket");
+
+    luaL_newmetatable(L, LUA_SOCKET_META);
+
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, ngx_lua_socket_free);
+    lua_setfield(L, -2, "__gc");
+
+    luaL_setfuncs(L, ngx_lua_socket_methods, 0);
+
+    lua_pop(L, 1);
+}
+
+
+static int
+ngx_lua_socket_error(lua_State *L, const char *err)
+{
+    lua_pushnil(L);
+    lua_pushstring(L, err);
+
+    return 2;
+}
+
+
+static int
+ngx_lua_socket_tcp(lua_State *L)
+{
+    ngx_lua_socket_t  *s;
+
+    /* the user value pins the string being sent */
+
+    s = lua_newuserdatauv(L, sizeof(ngx_lua_socket_t), 1);
+
+    ngx_memzero(s, sizeof(ngx_lua_socket_t));
+
+    s->timeout = NGX_LUA_SOCKET_TIMEOUT;
+
+    luaL_setmetatable(L, LUA_SOCKET_META);
+
+    return 1;
+}
+
+
+static ngx_lua_socket_t *
+ngx_lua_socket_check(lua_State *L)
+{
+    ngx_lua_socket_t  *s;
+
+    s = luaL_checkudata(L, 1, LUA_SOCKET_META);
+
+    if (s->handler != NULL) {
+        luaL_error(L, "socket is busy");
+    }
+
+    if (!lua_isyieldable(L)) {
+        luaL_error(L, "socket is not allowed here");
+    }
+
+    s->lua = ngx_lua_ext_get(L);
+
+    return s;
+}
+
+
+static int
+ngx_lua_socket_connect(lua_State *L)
+{
+    u_char                 *p;
+    ngx_int_t              rc;
+    ngx_url_t              u;
+    ngx_str_t              host;
+    ngx_addr_t             *addr;
+    lua_Integer            port;
+    ngx_lua_t              *lua;
+    ngx_connection_t       *c;
+    ngx_lua_socket_t       *s;
+    ngx_pool_cleanup_t     *cln;
+    ngx_peer_connection_t  *pc;
+
+    s = ngx_lua_socket_check(L);
+    lua = s->lua;
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url.data = (u_char *) luaL_checklstring(L, 2, &u.url.len);
+
+    port = luaL_optinteger(L, 3, 0);
+
+    if (port < 0 || port > 65535) {
+        return luaL_error(L, "port is out of range");
+    }
+
+    u.default_port = (in_port_t) port;
+
+    /* getaddrinfo() would block the worker, only addresses are accepted */
+
+    u.no_resolve = 1;
+
+    if (ngx_parse_url(lua->pool, &u) != NGX_OK) {
+        return ngx_lua_socket_error(L, u.err ? u.err : "invalid url");
+    }
+
+    if (u.naddrs == 0) {
+        host = u.host;
+
+        if (host.len > 2 && host.data[0] == '[') {
+            host.data++;
+            host.len -= 2;
+        }
+
+        /* the name is kept by the peer, so the address is not on stack */
+
+        addr = ngx_palloc(lua->pool, sizeof(ngx_addr_t));
+        if (addr == NULL) {
+            return luaL_error(L, "connect() failed");
+        }
+
+        if (ngx_parse_addr(lua->pool, addr, host.data, host.len) != NGX_OK) {
+            return ngx_lua_socket_error(L, "host is not an address");
+        }
+
+        ngx_inet_set_port(addr->sockaddr, u.port);
+
+        p = ngx_pnalloc(lua->pool, NGX_SOCKADDR_STRLEN);
+        if (p == NULL) {
+            return luaL_error(L, "connect() failed");
+        }
+
+        addr->name.len = ngx_sock_ntop(addr->sockaddr, addr->socklen, p,
+                                       NGX_SOCKADDR_STRLEN, 1);
+        addr->name.data = p;
+
+        u.addrs = addr;
+        u.naddrs = 1;
+    }
+
+    ngx_lua_socket_close(s);
+
+    cln = ngx_pool_cleanup_add(lua->pool, 0);
+    if (cln == NULL) {
+        return luaL_error(L, "connect() failed");
+    }
+
+    cln->handler = ngx_lua_socket_cleanup;
+    cln->data = s;
+
+    s->cleanup = cln;
+
+    pc = &s->peer;
+
+    pc->sockaddr = u.addrs[0].sockaddr;
+    pc->socklen = u.addrs[0].socklen;
+    pc->name = &u.addrs[0].name;
+    pc->get = ngx_event_get_peer;
+    pc->log = lua->log;
+    pc->log_error = NGX_ERROR_ERR;
+
+    if (ngx_lua_socket_keepalive_get(s) == NGX_OK) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    rc = ngx_event_connect_peer(pc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_lua_socket_close(s);
+        return ngx_lua_socket_error(L, "connect failed");
+    }
+
+    c = pc->connection;
+
+    c->data = s;
+    c->read->handler = ngx_lua_socket_event_handler;
+    c->write->handler = ngx_lua_socket_event_handler;
+
+    if (rc == NGX_AGAIN) {
+        s->handler = ngx_lua_socket_connect_handler;
+        ngx_add_timer(c->write, s->timeout);
+
+        return ngx_lua_yield(lua);
+    }
+
+    lua_pushboolean(L, 1);
+
+    return 1;
+}
+
+
+static void
+ngx_lua_socket_connect_handler(ngx_lua_socket_t *s, ngx_event_t *ev)
+{
+    int               err;
+    socklen_t         len;
+    lua_State         *L;
+    ngx_connection_t  *c;
+
+    L = s->lua->state;
+    c = s->peer.connection;
+
+    if (ev->timedout) {
+        ngx_lua_socket_close(s);
+        ngx_lua_socket_error(L, "timeout");
+        ngx_lua_socket_wake(s, 2);
+        return;
+    }
+
+    err = 0;
+    len = sizeof(int);
+
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) == -1) {
+        err = ngx_socket_errno;
+    }
+
+    if (err) {
+        (void) ngx_connection_error(c, err, "connect() failed");
+
+        ngx_lua_socket_close(s);
+        ngx_lua_socket_error(L, "connect failed");
+        ngx_lua_socket_wake(s, 2);
+        return;
+    }
+
+    lua_pushboolean(L, 1);
+    ngx_lua_socket_wake(s, 1);
+}
+
+
+static int
+ngx_lua_socket_send(lua_State *L)
+{
+    ngx_int_t         rc;
+    ngx_connection_t  *c;
+    ngx_lua_socket_t  *s;
+
+    s = ngx_lua_socket_check(L);
+
+    s->send.data = (u_char *) luaL_checklstring(L, 2, &s->send.len);
+    s->size = s->send.len;
+
+    c = s->peer.connection;
+
+    if (c == NULL) {
+        return ngx_lua_socket_error(L, "closed");
+    }
+
+    rc = ngx_lua_socket_write(s);
+
+    if (rc == NGX_ERROR) {
+        ngx_lua_socket_close(s);
+        return ngx_lua_socket_error(L, "send failed");
+    }
+
+    if (rc == NGX_OK) {
+        lua_pushinteger(L, s->size);
+        return 1;
+    }
+
+    lua_pushvalue(L, 2);
+    lua_setiuservalue(L, 1, 1);
+
+    s->handler = ngx_lua_socket_send_handler;
+    ngx_add_timer(c->write, s->timeout);
+
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        ngx_lua_socket_close(s);
+        return ngx_lua_socket_error(L, "send failed");
+    }
+
+    return ngx_lua_yield(s->lua);
+}
+
+
+static void
+ngx_lua_socket_send_handler(ngx_lua_socket_t *s, ngx_event_t *ev)
+{
+    ngx_int_t         rc;
+    lua_State         *L;
+    ngx_connection_t  *c;
+
+    if (!ev->write) {
+        return;
+    }
+
+    L = s->lua->state;
+    c = s->peer.connection;
+
+    if (ev->timedout) {
+        ngx_lua_socket_close(s);
+        ngx_lua_socket_error(L, "timeout");
+        ngx_lua_socket_wake(s, 2);
+        return;
+    }
+
+    rc = ngx_lua_socket_write(s);
+
+    if (rc == NGX_AGAIN) {
+        if (ngx_handle_write_event(c->write, 0) == NGX_OK) {
+            return;
+        }
+
+        rc = NGX_ERROR;
+    }
+
+    if (rc == NGX_ERROR) {
+        ngx_lua_socket_close(s);
+        ngx_lua_socket_error(L, "send failed");
+        ngx_lua_socket_wake(s, 2);
+        return;
+    }
+
+    lua_pushinteger(L, s->size);
+    ngx_lua_socket_wake(s, 1);
+}
+
+
+static ngx_int_t
+ngx_lua_socket_write(ngx_lua_socket_t *s)
+{
+    ssize_t           n;
+    ngx_connection_t  *c;
+
+    c = s->peer.connection;
+
+    while (s->send.len > 0) {
+        n = c->send(c, s->send.data, s->send.len);
+
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (n == NGX_AGAIN) {
+            return NGX_AGAIN;
+        }
+
+        s->send.data += n;
+        s->send.len -= n;
+    }
+
+    return NGX_OK;
+}
+
+
+static int
+ngx_lua_socket_receive(lua_State *L)
+{
+    ngx_int_t         rc;
+    ngx_str_t         pattern;
+    lua_Integer       size;
+    ngx_connection_t  *c;
+    ngx_lua_socket_t  *s;
+
+    s = ngx_lua_socket_check(L);
+
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+        size = lua_tointeger(L, 2);
+
+        if (size <= 0) {
+            return luaL_error(L, "size is out of range");
+        }
+
+        s->pattern = NGX_LUA_SOCKET_SIZE;
+        s->size = size;
+
+    } else {
+        pattern.data = (u_char *) luaL_optlstring(L, 2, "*l", &pattern.len);
+
+        if (pattern.len == 2 && ngx_strcmp(pattern.data, "*l") == 0) {
+            s->pattern = NGX_LUA_SOCKET_LINE;
+
+        } else if (pattern.len == 2 && ngx_strcmp(pattern.data, "*a") == 0) {
+            s->pattern = NGX_LUA_SOCKET_ALL;
+
+        } else {
+            return luaL_error(L, "bad pattern \"%s\"", pattern.data);
+        }
+    }
+
+    c = s->peer.connection;
+
+    if (c == NULL) {
+        return ngx_lua_socket_error(L, "closed");
+    }
+
+    rc = ngx_lua_socket_read(s, L);
+
+    if (rc == NGX_OK) {
+        return 1;
+    }
+
+    if (rc == NGX_ERROR) {
+        return 2;
+    }
+
+    s->handler = ngx_lua_socket_read_handler;
+    ngx_add_timer(c->read, s->timeout);
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_lua_socket_close(s);
+        return ngx_lua_socket_error(L, "receive failed");
+    }
+
+    return ngx_lua_yield(s->lua);
+}
+
+
+static void
+ngx_lua_socket_read_handler(ngx_lua_socket_t *s, ngx_event_t *ev)
+{
+    ngx_int_t         rc;
+    lua_State         *L;
+    ngx_connection_t  *c;
+
+    if (ev->write) {
+        return;
+    }
+
+    L = s->lua->state;
+    c = s->peer.connection;
+
+    if (ev->timedout) {
+        ngx_lua_socket_close(s);
+        ngx_lua_socket_error(L, "timeout");
+        ngx_lua_socket_wake(s, 2);
+        return;
+    }
+
+    rc = ngx_lua_socket_read(s, L);
+
+    if (rc == NGX_AGAIN) {
+        if (ngx_handle_read_event(c->read, 0) == NGX_OK) {
+            return;
+        }
+
+        ngx_lua_socket_close(s);
+        ngx_lua_socket_error(L, "receive failed");
+        rc = NGX_ERROR;
+    }
+
+    ngx_lua_socket_wake(s, (rc == NGX_OK) ? 1 : 2);
+}
+
+
+static ngx_int_t
+ngx_lua_socket_buffer(ngx_lua_socket_t *s)
+{
+    size_t     size, used;
+    u_char     *p;
+    ngx_buf_t  *b;
+
+    b = &s->buffer;
+
+    used = b->last - b->pos;
+
+    if (b->pos > b->start) {
+        b->last = ngx_movemem(b->start, b->pos, used);
+        b->pos = b->start;
+
+        if (s->pattern != NGX_LUA_SOCKET_SIZE
+            || s->size <= (size_t) (b->end - b->start))
+        {
+            return NGX_OK;
+        }
+    }
+
+    size = (b->start == NULL) ? NGX_LUA_SOCKET_BUFFER_SIZE
+                              : 2 * (size_t) (b->end - b->start);
+
+    if (s->pattern == NGX_LUA_SOCKET_SIZE && size < s->size) {
+        size = s->size;
+    }
+
+    p = ngx_alloc(size, s->lua->log);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (b->start != NULL) {
+        ngx_memcpy(p, b->pos, used);
+        ngx_free(b->start);
+    }
+
+    b->start = p;
+    b->pos = p;
+    b->last = p + used;
+    b->end = p + size;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_lua_socket_read(ngx_lua_socket_t *s, lua_State *L)
+{
+    u_char            *p;
+    size_t            size;
+    ssize_t           n;
+    ngx_buf_t         *b;
+    ngx_connection_t  *c;
+
+    c = s->peer.connection;
+    b = &s->buffer;
+
+    for ( ;; ) {
+
+        size = b->last - b->pos;
+
+        switch (s->pattern) {
+
+        case NGX_LUA_SOCKET_SIZE:
+            if (size >= s->size) {
+                lua_pushlstring(L, (char *) b->pos, s->size);
+                b->pos += s->size;
+                return NGX_OK;
+            }
+
+            break;
+
+        case NGX_LUA_SOCKET_LINE:
+            p = ngx_strlchr(b->pos, b->last, LF);
+
+            if (p != NULL) {
+                size = p - b->pos;
+
+                if (size > 0 && p[-1] == CR) {
+                    size--;
+                }
+
+                lua_pushlstring(L, (char *) b->pos, size);
+                b->pos = p + 1;
+                return NGX_OK;
+            }
+
+            break;
+
+        default: /* NGX_LUA_SOCKET_ALL */
+
+            if (s->eof) {
+                lua_pushlstring(L, (char *) b->pos, size);
+                b->pos = b->last;
+                return NGX_OK;
+            }
+        }
+
+        if (s->eof) {
+            ngx_lua_socket_error(L, "closed");
+            return NGX_ERROR;
+        }
+
+        if (b->last == b->end && ngx_lua_socket_buffer(s) != NGX_OK) {
+            ngx_lua_socket_error(L, "no memory");
+            return NGX_ERROR;
+        }
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            return NGX_AGAIN;
+        }
+
+        if (n == NGX_ERROR) {
+            ngx_lua_socket_close(s);
+            ngx_lua_socket_error(L, "receive failed");
+            return NGX_ERROR;
+        }
+
+        if (n == 0) {
+            s->eof = 1;
+            continue;
+        }
+
+        b->last += n;
+    }
+}
+
+
+static int
+ngx_lua_socket_settimeout(lua_State *L)
+{
+    lua_Integer       timeout;
+    ngx_lua_socket_t  *s;
+
+    s = luaL_checkudata(L, 1, LUA_SOCKET_META);
+    timeout = luaL_checkinteger(L, 2);
+
+    if (timeout <= 0 || timeout > NGX_MAX_INT32_VALUE) {
+        return luaL_error(L, "timeout is out of range");
+    }
+
+    s->timeout = (ngx_msec_t) timeout;
+
+    return 0;
+}
+
+
+static int
+ngx_lua_socket_setkeepalive(lua_State *L)
+{
+    lua_Integer             timeout, size;
+    ngx_queue_t             *q;
+    ngx_connection_t        *c;
+    ngx_lua_socket_t        *s;
+    ngx_lua_socket_item_t   *item;
+    ngx_lua_socket_pool_t   *pool;
+
+    s = luaL_checkudata(L, 1, LUA_SOCKET_META);
+
+    timeout = luaL_optinteger(L, 2, NGX_LUA_SOCKET_TIMEOUT);
+    size = luaL_optinteger(L, 3, NGX_LUA_SOCKET_POOL_SIZE);
+
+    if (timeout < 0 || timeout > NGX_MAX_INT32_VALUE) {
+        return luaL_error(L, "timeout is out of range");
+    }
+
+    if (size <= 0) {
+        return luaL_error(L, "pool size is out of range");
+    }
+
+    if (s->handler != NULL) {
+        return luaL_error(L, "socket is busy");
+    }
+
+    c = s->peer.connection;
+
+    if (c == NULL) {
+        return ngx_lua_socket_error(L, "closed");
+    }
+
+    if (s->buffer.pos != s->buffer.last || s->eof
+        || c->read->eof || c->read->error || c->write->error)
+    {
+        ngx_lua_socket_close(s);
+        return ngx_lua_socket_error(L, "connection is not reusable");
+    }
+
+    pool = ngx_lua_socket_pool(s->peer.name, size);
+    if (pool == NULL) {
+        return luaL_error(L, "setkeepalive() failed");
+    }
+
+    if (ngx_queue_empty(&pool->free)) {
+
+        /* the pool is full, the least recently used connection goes */
+
+        q = ngx_queue_last(&pool->cache);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, ngx_lua_socket_item_t, queue);
+
+        ngx_close_connection(item->connection);
+
+    } else {
+        q = ngx_queue_head(&pool->free);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, ngx_lua_socket_item_t, queue);
+    }
+
+    ngx_queue_insert_head(&pool->cache, q);
+
+    item->connection = c;
+
+    if (s->cleanup != NULL) {
+        s->cleanup->handler = NULL;
+        s->cleanup = NULL;
+    }
+
+    s->peer.connection = NULL;
+    s->buffer.pos = s->buffer.start;
+    s->buffer.last = s->buffer.start;
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    if (timeout > 0) {
+        ngx_add_timer(c->read, (ngx_msec_t) timeout);
+    }
+
+    c->read->handler = ngx_lua_socket_keepalive_handler;
+    c->write->handler = ngx_lua_socket_keepalive_handler;
+
+    c->data = item;
+    c->idle = 1;
+
+    c->log = ngx_cycle->log;
+    c->read->log = ngx_cycle->log;
+    c->write->log = ngx_cycle->log;
+
+    if (c->read->ready) {
+        ngx_lua_socket_keepalive_handler(c->read);
+    }
+
+    lua_pushboolean(L, 1);
+
+    return 1;
+}
+
+
+static ngx_lua_socket_pool_t *
+ngx_lua_socket_pool(ngx_str_t *name, ngx_uint_t size)
+{
+    ngx_queue_t            *q;
+    ngx_lua_socket_pool_t  *pool;
+
+    if (ngx_lua_socket_pools.next == NULL) {
+        ngx_queue_init(&ngx_lua_socket_pools);
+    }
+
+    for (q = ngx_queue_head(&ngx_lua_socket_pools);
+         q != ngx_queue_sentinel(&ngx_lua_socket_pools);
+         q = ngx_queue_next(q))
+    {
+        pool = ngx_queue_data(q, ngx_lua_socket_pool_t, queue);
+
+        if (pool->name.len == name->len
+            && ngx_strncmp(pool->name.data, name->data, name->len) == 0)
+        {
+            goto found;
+        }
+    }
+
+    if (size == 0) {
+        return NULL;
+    }
+
+    /* pools live as long as the worker */
+
+    pool = ngx_palloc(ngx_cycle->pool, sizeof(ngx_lua_socket_pool_t)
+                                       + name->len);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->name.len = name->len;
+    pool->name.data = (u_char *) &pool[1];
+    ngx_memcpy(pool->name.data, name->data, name->len);
+
+    ngx_queue_init(&pool->cache);
+    ngx_queue_init(&pool->free);
+    ngx_queue_init(&pool->spare);
+
+    pool->size = 0;
+
+    ngx_queue_insert_tail(&ngx_lua_socket_pools, &pool->queue);
+
+found:
+
+    if (size != 0 && size != pool->size) {
+        if (ngx_lua_socket_pool_resize(pool, size) != NGX_OK) {
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+
+static ngx_int_t
+ngx_lua_socket_pool_resize(ngx_lua_socket_pool_t *pool, ngx_uint_t size)
+{
+    ngx_uint_t             i, n;
+    ngx_queue_t            *q;
+    ngx_lua_socket_item_t  *item;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
+                   "lua socket pool %V: resize %ui to %ui",
+                   &pool->name, pool->size, size);
+
+    /* free items go first, then the least recently used connections */
+
+    while (pool->size > size) {
+
+        if (!ngx_queue_empty(&pool->free)) {
+            q = ngx_queue_head(&pool->free);
+
+        } else {
+            q = ngx_queue_last(&pool->cache);
+
+            item = ngx_queue_data(q, ngx_lua_socket_item_t, queue);
+
+            ngx_close_connection(item->connection);
+        }
+
+        ngx_queue_remove(q);
+        ngx_queue_insert_tail(&pool->spare, q);
+
+        pool->size--;
+    }
+
+    while (pool->size < size) {
+
+        if (ngx_queue_empty(&pool->spare)) {
+            n = size - pool->size;
+
+            item = ngx_palloc(ngx_cycle->pool,
+                              sizeof(ngx_lua_socket_item_t) * n);
+            if (item == NULL) {
+                return NGX_ERROR;
+            }
+
+            for (i = 0; i < n; i++) {
+                item[i].pool = pool;
+                ngx_queue_insert_tail(&pool->spare, &item[i].queue);
+            }
+        }
+
+        q = ngx_queue_head(&pool->spare);
+        ngx_queue_remove(q);
+        ngx_queue_insert_tail(&pool->free, q);
+
+        pool->size++;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_lua_socket_keepalive_get(ngx_lua_socket_t *s)
+{
+    ngx_queue_t            *q;
+    ngx_connection_t       *c;
+    ngx_lua_socket_item_t  *item;
+    ngx_lua_socket_pool_t  *pool;
+
+    pool = ngx_lua_socket_pool(s->peer.name, 0);
+
+    if (pool == NULL || ngx_queue_empty(&pool->cache)) {
+        return NGX_DECLINED;
+    }
+
+    q = ngx_queue_head(&pool->cache);
+    ngx_queue_remove(q);
+
+    item = ngx_queue_data(q, ngx_lua_socket_item_t, queue);
+    ngx_queue_insert_head(&pool->free, q);
+
+    c = item->connection;
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    c->idle = 0;
+    c->data = s;
+
+    c->log = s->peer.log;
+    c->read->log = c->log;
+    c->write->log = c->log;
+
+    c->read->handler = ngx_lua_socket_event_handler;
+    c->write->handler = ngx_lua_socket_event_handler;
+
+    s->peer.connection = c;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "lua socket keepalive: reuse %V", s->peer.name);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_lua_socket_keepalive_handler(ngx_event_t *ev)
+{
+    char                   buf[1];
+    ssize_t                n;
+    ngx_connection_t       *c;
+    ngx_lua_socket_item_t  *item;
+
+    c = ev->data;
+
+    if (ev->write) {
+        return;
+    }
+
+    if (c->close || ev->timedout) {
+        goto close;
+    }
+
+    /* an idle connection must not have anything to read */
+
+    n = recv(c->fd, buf, 1, MSG_PEEK);
+
+    if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+        ev->ready = 0;
+
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            goto close;
+        }
+
+        return;
+    }
+
+close:
+
+    item = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "lua socket keepalive: close");
+
+    ngx_queue_remove(&item->queue);
+    ngx_queue_insert_head(&item->pool->free, &item->queue);
+
+    ngx_close_connection(c);
+}
+
+
+static int
+ngx_lua_socket_close_method(lua_State *L)
+{
+    ngx_lua_socket_t  *s;
+
+    s = luaL_checkudata(L, 1, LUA_SOCKET_META);
+
+    if (s->handler != NULL) {
+        return luaL_error(L, "socket is busy");
+    }
+
+    if (s->peer.connection == NULL) {
+        return ngx_lua_socket_error(L, "closed");
+    }
+
+    ngx_lua_socket_close(s);
+
+    lua_pushboolean(L, 1);
+
+    return 1;
+}
+
+
+static int
+ngx_lua_socket_free(lua_State *L)
+{
+    ngx_lua_socket_t  *s;
+
+    s = lua_touserdata(L, 1);
+
+    ngx_lua_socket_close(s);
+
+    if (s->buffer.start != NULL) {
+        ngx_free(s->buffer.start);
+        s->buffer.start = NULL;
+    }
+
+    return 0;
+}
+
+
+static void
+ngx_lua_socket_event_handler(ngx_event_t *ev)
+{
+    ngx_connection_t  *c;
+    ngx_lua_socket_t  *s;
+
+    c = ev->data;
+    s = c->data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "lua socket event handler: %d", ev->write);
+
+    if (s->handler == NULL) {
+        return;
+    }
+
+    s->handler(s, ev);
+}
+
+
+static void
+ngx_lua_socket_wake(ngx_lua_socket_t *s, int nresults)
+{
+    ngx_connection_t  *c;
+
+    s->handler = NULL;
+
+    c = s->peer.connection;
+
+    if (c != NULL) {
+        if (c->read->timer_set) {
+            ngx_del_timer(c->read);
+        }
+
+        if (c->write->timer_set) {
+            ngx_del_timer(c->write);
+        }
+    }
+
+    ngx_lua_wake(s->lua, nresults);
+}
+
+
+static void
+ngx_lua_socket_close(ngx_lua_socket_t *s)
+{
+    if (s->cleanup != NULL) {
+        s->cleanup->handler = NULL;
+        s->cleanup = NULL;
+    }
+
+    if (s->peer.connection != NULL) {
+        ngx_close_connection(s->peer.connection);
+        s->peer.connection = NULL;
+    }
+
+    s->handler = NULL;
+    s->eof = 0;
+
+    s->buffer.pos = s->buffer.start;
+    s->buffer.last = s->buffer.start;
+}
+
+
+static void
+ngx_lua_socket_cleanup(void *data)
+{
+    ngx_lua_socket_t  *s = data;
+
+    /* the pool of the coroutine that connected the socket is going away */
+
+    s->cleanup = NULL;
+
+    ngx_lua_socket_close(s);
+
+    s->lua = NULL;
+}